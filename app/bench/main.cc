@@ -0,0 +1,247 @@
+#include <arpa/inet.h>
+#include <netinet/tcp.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "boots/event_loop.h"
+
+// Round-trip latency of a small TCP echo served by one EventLoop, next to
+// the CPU the loop thread burned to get it, so that EventLoopOptions can be
+// compared:
+//
+//   bench [--cpu N] [--numa] [--spin-us N] [--busy-poll-us N]
+//         [--client-cpu N] [--rounds N] [--size N]
+
+using Clock = std::chrono::steady_clock;
+
+struct BenchOptions {
+  boots::EventLoopOptions loop{};
+  int client_cpu{-1};
+  size_t rounds{100000};
+  size_t size{64};
+};
+
+static bool ParseArgs(int argc, char **argv, BenchOptions *options) {
+  for (int i = 1; i < argc; ++i) {
+    const char *arg = argv[i];
+    const char *value = i + 1 < argc ? argv[i + 1] : nullptr;
+    if (strcmp(arg, "--numa") == 0) {
+      options->loop.numa_local = true;
+      continue;
+    }
+    if (value == nullptr) {
+      return false;
+    }
+    ++i;
+    if (strcmp(arg, "--cpu") == 0) {
+      options->loop.cpu = atoi(value);
+    } else if (strcmp(arg, "--spin-us") == 0) {
+      options->loop.spin_budget = std::chrono::microseconds{atoi(value)};
+    } else if (strcmp(arg, "--busy-poll-us") == 0) {
+      options->loop.busy_poll = std::chrono::microseconds{atoi(value)};
+    } else if (strcmp(arg, "--client-cpu") == 0) {
+      options->client_cpu = atoi(value);
+    } else if (strcmp(arg, "--rounds") == 0) {
+      options->rounds = strtoul(value, nullptr, 10);
+      if (options->rounds == 0) {
+        return false;
+      }
+    } else if (strcmp(arg, "--size") == 0) {
+      options->size = std::max<size_t>(1, strtoul(value, nullptr, 10));
+    } else {
+      return false;
+    }
+  }
+  return true;
+}
+
+static std::chrono::nanoseconds ThreadCpuTime() {
+  timespec ts{};
+  clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+  return std::chrono::seconds{ts.tv_sec} +
+         std::chrono::nanoseconds{ts.tv_nsec};
+}
+
+// Echoes one connection. What the socket cannot take yet is held back,
+// and reading pauses, until it is writable again.
+struct Echo {
+  std::string pending{};
+  bool blocked{};
+};
+
+// Serves an echo on `listen_fd` until the client disconnects or fails.
+static void Serve(const boots::EventLoopOptions &options, int listen_fd,
+                  std::chrono::nanoseconds *cpu) {
+  boots::EventLoop loop{options};
+  loop.TuneSocket(listen_fd);
+  loop.Add(listen_fd, boots::EventLoop::kPollIn, [&loop](int fd, uint32_t) {
+    int conn = accept4(fd, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if (conn < 0) {
+      // The client gave up before connecting and shut the listener down.
+      if (errno != EAGAIN && errno != EWOULDBLOCK) {
+        loop.Stop();
+      }
+      return;
+    }
+    int val{1};
+    setsockopt(conn, IPPROTO_TCP, TCP_NODELAY, &val, sizeof(val));
+    loop.TuneSocket(conn);
+    auto echo = std::make_shared<Echo>();
+    loop.Add(conn, boots::EventLoop::kPollIn, [&loop, echo](int fd, uint32_t) {
+      auto drop = [&loop, fd] {
+        loop.Remove(fd);
+        close(fd);
+        loop.Stop();
+      };
+      if (echo->pending.empty()) {
+        char buf[16 * 1024];
+        auto n = read(fd, buf, sizeof(buf));
+        if (n <= 0) {
+          if (n == 0 || (errno != EAGAIN && errno != EWOULDBLOCK)) {
+            drop();
+          }
+          return;
+        }
+        echo->pending.assign(buf, n);
+      }
+      while (!echo->pending.empty()) {
+        auto w = send(fd, echo->pending.data(), echo->pending.size(),
+                      MSG_NOSIGNAL);
+        if (w < 0) {
+          if (errno != EAGAIN && errno != EWOULDBLOCK) {
+            drop();
+          } else if (!echo->blocked) {
+            echo->blocked = true;
+            loop.Modify(fd, boots::EventLoop::kPollOut);
+          }
+          return;
+        }
+        echo->pending.erase(0, w);
+      }
+      if (echo->blocked) {
+        echo->blocked = false;
+        loop.Modify(fd, boots::EventLoop::kPollIn);
+      }
+    });
+  });
+  auto start = ThreadCpuTime();
+  loop.Run();
+  *cpu = ThreadCpuTime() - start;
+}
+
+static bool RoundTrip(int fd, std::vector<char> *buf) {
+  auto n = write(fd, buf->data(), buf->size());
+  if (n != static_cast<ssize_t>(buf->size())) {
+    return false;
+  }
+  for (size_t got = 0; got < buf->size();) {
+    n = read(fd, buf->data() + got, buf->size() - got);
+    if (n <= 0) {
+      return false;
+    }
+    got += n;
+  }
+  return true;
+}
+
+int main(int argc, char **argv) {
+  BenchOptions options{};
+  if (!ParseArgs(argc, argv, &options)) {
+    fprintf(stderr,
+            "usage: %s [--cpu N] [--numa] [--spin-us N] [--busy-poll-us N] "
+            "[--client-cpu N] [--rounds N] [--size N]\n",
+            argv[0]);
+    return 1;
+  }
+
+  int listen_fd =
+      socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  sockaddr_in sa{AF_INET, 0, {htonl(INADDR_LOOPBACK)}};
+  socklen_t len = sizeof(sa);
+  if (listen_fd < 0 ||
+      bind(listen_fd, reinterpret_cast<sockaddr *>(&sa), sizeof(sa)) != 0 ||
+      listen(listen_fd, 1) != 0 ||
+      getsockname(listen_fd, reinterpret_cast<sockaddr *>(&sa), &len) != 0) {
+    perror("listen");
+    return 1;
+  }
+  std::chrono::nanoseconds loop_cpu{};
+  std::thread server{Serve, options.loop, listen_fd, &loop_cpu};
+
+  if (options.client_cpu >= 0) {
+    cpu_set_t set{};
+    CPU_ZERO(&set);
+    CPU_SET(options.client_cpu, &set);
+    pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+  }
+  // Closing the client ends the server loop, so that it can be joined on
+  // every path out of here.
+  int fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  auto fail = [&](const char *what) {
+    perror(what);
+    close(fd);
+    // Unblocks a server that never got the connection.
+    shutdown(listen_fd, SHUT_RDWR);
+    server.join();
+    close(listen_fd);
+    return 1;
+  };
+  int val{1};
+  setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &val, sizeof(val));
+  if (connect(fd, reinterpret_cast<sockaddr *>(&sa), sizeof(sa)) != 0) {
+    return fail("connect");
+  }
+
+  std::vector<char> buf(options.size, 'x');
+  auto start = Clock::now();
+  for (size_t i = 0; i < std::min<size_t>(options.rounds / 10, 10000); ++i) {
+    if (!RoundTrip(fd, &buf)) {
+      return fail("warm-up round trip");
+    }
+  }
+  std::vector<int64_t> samples{};
+  samples.reserve(options.rounds);
+  for (size_t i = 0; i < options.rounds; ++i) {
+    auto begin = Clock::now();
+    if (!RoundTrip(fd, &buf)) {
+      return fail("round trip");
+    }
+    samples.push_back(
+        std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() -
+                                                             begin)
+            .count());
+  }
+  auto wall = Clock::now() - start;
+  close(fd);
+  server.join();
+  close(listen_fd);
+
+  std::sort(samples.begin(), samples.end());
+  auto percentile = [&samples](double p) {
+    auto idx =
+        static_cast<size_t>(p * static_cast<double>(samples.size() - 1));
+    return static_cast<double>(samples[idx]) / 1000;
+  };
+  printf("rounds=%zu size=%zu cpu=%d spin_us=%lld busy_poll_us=%lld numa=%d\n",
+         options.rounds, options.size, options.loop.cpu,
+         static_cast<long long>(options.loop.spin_budget.count()),
+         static_cast<long long>(options.loop.busy_poll.count()),
+         options.loop.numa_local);
+  printf("rtt_us p50=%.1f p90=%.1f p99=%.1f p999=%.1f max=%.1f\n",
+         percentile(0.5), percentile(0.9), percentile(0.99),
+         percentile(0.999), percentile(1));
+  // Loop CPU time per wall second of the run; 1.0 is one core kept busy.
+  printf("loop_cpu=%.2f\n", std::chrono::duration<double>(loop_cpu).count() /
+                                std::chrono::duration<double>(wall).count());
+  return 0;
+}
@@ -1,12 +1,26 @@
+#include <unistd.h>
+
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+
 #include "boots/dns_resolver.h"
+#include "boots/dns_server.h"
 #include "boots/event_loop.h"
+#include "boots/handoff.h"
+#include "boots/tcp_relay.h"
+
+// Sessions still open this long after a handoff are cut off.
+static constexpr auto kDrainTimeout = std::chrono::seconds{30};
+static constexpr const char *kHandoffSocketName = "boots-server.sock";
 
-int main() {
+static int Resolve() {
   boots::EventLoop loop{};
   auto r = std::make_shared<boots::DnsResolver>(&loop);
   r->Init();
   auto callback = [](const auto &, const auto &ip, const auto &) {
-    printf("ip: %s\n", ip.data());
+    printf("ip: %s\n", ip.ToString().c_str());
   };
   for (int i = 0; i < 3; ++i) {
     r->Resolve("lws.dingtalk.com", callback);
@@ -16,3 +30,88 @@ int main() {
   loop.Run();
   return 0;
 }
+
+// Serves DNS on `address`:`port` for the local host, forwarding misses to
+// the servers in /etc/resolv.conf.
+static int Serve(const std::string &address, uint16_t port) {
+  boots::EventLoop loop{};
+  auto resolver = std::make_shared<boots::DnsResolver>(&loop);
+  resolver->Init();
+  boots::DnsServerOptions options{};
+  options.address = address;
+  options.port = port;
+  auto server = std::make_shared<boots::DnsServer>(&loop, resolver, options);
+  if (!server->Init()) {
+    return 1;
+  }
+  loop.Run();
+  return 0;
+}
+
+// Relays `port` to `host`:`target_port`. Another instance started with the
+// same `handoff_path` takes over the listening and resolver sockets and the
+// DNS cache, after which this one drains its sessions and exits.
+static int Relay(uint16_t port, const std::string &host, uint16_t target_port,
+                 const std::string &handoff_path) {
+  boots::EventLoop loop{};
+  boots::DnsResolverOptions resolver_options{};
+  boots::TcpRelayOptions relay_options{};
+  relay_options.target_host = host;
+  relay_options.target_port = target_port;
+
+  std::vector<int> fds{};
+  std::string cache{};
+  if (boots::ReceiveHandoff(handoff_path, &fds, &cache)) {
+    if (fds.size() == 2) {
+      relay_options.listen_fd = fds[0];
+      resolver_options.socket_fd = fds[1];
+    } else {
+      for (int fd : fds) {
+        close(fd);
+      }
+      cache.clear();
+    }
+  }
+
+  auto resolver = std::make_shared<boots::DnsResolver>(
+      &loop, std::vector<std::string>{}, resolver_options);
+  resolver->Init();
+  resolver->ImportCache(cache);
+  auto relay =
+      std::make_shared<boots::TcpRelay>(&loop, resolver, port, relay_options);
+  relay->Init();
+
+  auto handoff = std::make_shared<boots::HandoffListener>(&loop, handoff_path);
+  handoff->Init(
+      [&](std::vector<int> *fds, std::string *data) {
+        fds->push_back(relay->ListenFd());
+        fds->push_back(resolver->Fd());
+        *data = resolver->ExportCache();
+      },
+      [&] {
+        resolver->Detach();
+        relay->Shutdown([&loop] { loop.Stop(); });
+        loop.RunAfter(kDrainTimeout, [&loop] { loop.Stop(); });
+      });
+  loop.Run();
+  return 0;
+}
+
+// Usage:
+//   server                                    resolve a few names
+//   server relay PORT HOST HOST_PORT [PATH]   relay, taking over from the
+//                                             instance serving PATH if any
+//   server dns [ADDRESS [PORT]]               local caching DNS forwarder
+int main(int argc, char **argv) {
+  if (argc >= 2 && strcmp(argv[1], "dns") == 0) {
+    return Serve(argc > 2 ? argv[2] : "127.0.0.1",
+                 static_cast<uint16_t>(argc > 3 ? atoi(argv[3]) : 53));
+  }
+  if (argc >= 5 && strcmp(argv[1], "relay") == 0) {
+    return Relay(static_cast<uint16_t>(atoi(argv[2])), argv[3],
+                 static_cast<uint16_t>(atoi(argv[4])),
+                 argc > 5 ? argv[5]
+                          : boots::PrivateRuntimePath(kHandoffSocketName));
+  }
+  return Resolve();
+}
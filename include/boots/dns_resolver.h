@@ -2,29 +2,198 @@
 #include <arpa/inet.h>
 
 #include <atomic>
+#include <chrono>
+#include <deque>
 #include <functional>
 #include <memory>
+#include <span>
 #include <string>
+#include <string_view>
 #include <unordered_map>
 #include <vector>
 
+#include "boots/ip_address.h"
 #include "boots/lru_cache.h"
 
 namespace boots {
 class DnsResponse;
+class DnsTcpTransport;
 class EventLoop;
+class FrequencySketch;
+enum class ResponseCode : uint16_t;
+
+// Payload size advertised in OPT; avoids IP fragmentation on common paths
+// (DNS Flag Day 2020).
+constexpr uint16_t kDefaultEdnsPayloadSize = 1232;
+
+struct DnsResolverOptions {
+  // A cache hit within the last `refresh_ahead_ratio` of the entry's TTL
+  // starts a background re-query. Zero disables refresh-ahead.
+  double refresh_ahead_ratio{0.1};
+  // Minimum estimated recent hits before an entry is worth refreshing.
+  uint32_t refresh_ahead_min_hits{4};
+  size_t frequency_sketch_width{4096};
+  // Upper bound on upstream queries ResolveMany() keeps in flight; the rest
+  // wait in a queue so a bulk resolve cannot overflow the servers' buffers.
+  size_t max_bulk_inflight{128};
+  // Sends every query over TCP instead of only retrying truncated answers.
+  bool force_tcp{false};
+  size_t tcp_connections_per_server{2};
+  // UDP payload size advertised through EDNS(0); zero sends plain queries.
+  uint16_t edns_payload_size{kDefaultEdnsPayloadSize};
+  // Adopts a UDP socket, e.g. one handed over by the process being
+  // replaced, instead of opening one.
+  int socket_fd{-1};
+  // Names queried upstream at once; further misses wait in FIFO order.
+  size_t max_outstanding{256};
+  // Queries per second sent to each server, in bursts of up to
+  // `upstream_burst`; zero leaves them unpaced.
+  double upstream_qps{0};
+  double upstream_burst{20};
+  // A miss still waiting for an upstream slot after this long fails rather
+  // than queue without bound. ResolveMany() queues are exempt.
+  std::chrono::milliseconds max_queue_time{500};
+  // An unanswered query fails after this long and frees its slot.
+  std::chrono::milliseconds query_timeout{5000};
+};
+
 class DnsResolver : public std::enable_shared_from_this<DnsResolver> {
  public:
   using CallbackFunc =
-      std::function<void(const std::string &hostname, const std::string &ip,
+      std::function<void(const std::string &hostname, const IpAddress &ip,
                          const std::string &error)>;
+  struct Result {
+    std::string hostname;
+    IpAddress ip;
+    std::string error;
+  };
+  using BulkCallbackFunc =
+      std::function<void(const std::vector<Result> &results)>;
+  using LookupCallbackFunc =
+      std::function<void(const IpAddress &ip, ResponseCode rcode,
+                         std::chrono::seconds ttl, const std::string &error)>;
+  // The TTL of answers from literals and /etc/hosts, which never expire.
+  static constexpr std::chrono::seconds kNoExpiry =
+      std::chrono::seconds::max();
   explicit DnsResolver(EventLoop *loop,
-                       const std::vector<std::string> &servers = {});
+                       const std::vector<std::string> &servers = {},
+                       const DnsResolverOptions &options = {});
+  ~DnsResolver();
   void Init();
   void Resolve(const std::string &hostname, CallbackFunc callback);
+  // Resolves the distinct names in `hostnames` and calls `callback` once with
+  // one result per distinct name, in first-seen order.
+  void ResolveMany(std::span<const std::string> hostnames,
+                   BulkCallbackFunc callback);
+  // Resolves `hostname` like Resolve(), also passing the answer's rcode and
+  // remaining TTL, rounded up: zero if the answer was not cached, kNoExpiry
+  // if it never expires. NXDOMAIN, and NOERROR without an address, come
+  // with the TTL they are cached for; any other failure is SERVFAIL.
+  void Lookup(const std::string &hostname, LookupCallbackFunc callback);
+  // Answers `hostname` from an address literal or /etc/hosts only.
+  bool FindLocal(const std::string &hostname, IpAddress *ip) const;
+  // Counts a use of `hostname` that the caller answered from its own copy
+  // of an earlier result, so that the name still refreshes ahead while hot.
+  void Touch(const std::string &hostname);
+
+  [[nodiscard]] int Fd() const { return fd_; }
+  [[nodiscard]] std::vector<sockaddr_in> Servers() const;
+  // Stops reading the UDP socket once Fd() has been handed to a successor,
+  // which would otherwise lose answers to this process. Queries still
+  // outstanding, and any sent later, go over TCP instead.
+  void Detach();
+  // Serializes the live address and CNAME entries with their remaining
+  // TTLs, for a successor process to ImportCache() without a cold start.
+  [[nodiscard]] std::string ExportCache() const;
+  void ImportCache(std::string_view data);
 
  private:
-  void SendReq(const std::string &hostname);
+  using AddressCache = LRUCache<std::string, IpAddress>;
+  using AliasCache = LRUCache<std::string, std::string>;
+  using NegativeCache = LRUCache<std::string, ResponseCode>;
+  using Clock = std::chrono::steady_clock;
+  struct Bulk;
+  struct Batch;
+  struct Upstream {
+    sockaddr_in addr{};
+    // Cleared when the server rejects or ignores EDNS(0); probed again once
+    // `edns_probe_at` has passed.
+    bool edns{true};
+    Clock::time_point edns_probe_at{};
+    // Token bucket pacing the queries sent to this server.
+    double tokens{};
+    Clock::time_point refilled{};
+  };
+  struct Waiting {
+    std::string hostname;
+    Clock::time_point since;
+  };
+  struct Inflight {
+    // Tells a timeout from the query it was armed for.
+    uint64_t seq;
+    // Servers yet to answer; a failure from one waits for the others.
+    size_t servers;
+  };
+  struct TcpQuery {
+    // Queries still outstanding over TCP for the name.
+    size_t pending{};
+    // The truncated UDP answer, used if every TCP query fails.
+    std::shared_ptr<const DnsResponse> truncated{};
+  };
+
+  static constexpr size_t kMaxCnameChain = 8;
+
+  // On a miss, `canonical` is the end of the cached CNAME chain, which is
+  // the name that still has to be queried. On a hit, `ttl` if given is set
+  // as for Lookup().
+  bool ResolveLocal(const std::string &hostname, IpAddress *ip,
+                    std::string *error, std::string *canonical,
+                    std::chrono::seconds *ttl = nullptr);
+  // Waits for `canonical` from upstream, reporting the answer as `hostname`.
+  void ResolveRemote(const std::string &hostname, const std::string &canonical,
+                     CallbackFunc callback);
+  // The remaining TTL of the cached entry that gave `ip`, without counting
+  // a use; zero if there is none.
+  std::chrono::seconds CachedTtl(const std::string &hostname,
+                                 const IpAddress &ip);
+  // The rcode of the cached negative answer for `hostname`, setting `ttl`
+  // to its remaining TTL; SERVFAIL if there is none.
+  ResponseCode CachedNegative(const std::string &hostname,
+                              std::chrono::seconds *ttl);
+  // Lowers `expire`, if given, to that of the earliest link followed: an
+  // answer through aliases lives no longer than any of them.
+  bool FollowAliases(const std::string &hostname, std::string *canonical,
+                     AliasCache::TimePoint *expire = nullptr);
+  static CallbackFunc ReportAs(const std::string &hostname,
+                               CallbackFunc callback);
+  void AddCallback(const std::string &hostname, CallbackFunc callback);
+  // Sends `hostname` upstream now if a slot and a token allow, and queues it
+  // otherwise.
+  void Query(const std::string &hostname);
+  bool Admit(const std::string &hostname);
+  // Adds `hostname` for every server with a token to spare and returns how
+  // many got it.
+  size_t Dispatch(const std::string &hostname, Batch *batch);
+  void Flush(const Batch &batch);
+  bool TakeToken(Upstream *upstream, Clock::time_point now);
+  // Counts `hostname` as outstanding until answered or timed out.
+  void Track(const std::string &hostname, size_t servers);
+  void Expire(const std::string &hostname, uint64_t seq);
+  // Sends queued misses as slots and tokens allow, failing those that have
+  // waited too long.
+  void Pump();
+  void SchedulePump();
+  void Fail(std::string hostname, const std::string &error);
+  void SendBulk();
+  void SendTcp(const std::string &hostname, const sockaddr_in &server,
+               std::vector<uint8_t> query);
+  void RetryOverTcp(const DnsResponse &truncated, const sockaddr_in &server);
+  void OnTcpFailure(std::string_view query);
+  bool UseEdns(const Upstream &upstream) const;
+  bool CheckEdns(const DnsResponse &resp, const sockaddr_in &server);
+  void AddServer(const std::string &server);
+  void MaybeRefresh(const std::string &hostname,
+                    const AddressCache::Pair &entry);
 
   void Callback(int fd, uint32_t events);
   void Handle(const DnsResponse &resp);
@@ -33,12 +202,29 @@ class DnsResolver : public std::enable_shared_from_this<DnsResolver> {
   void ParseHosts();
 
   EventLoop *loop_;
+  DnsResolverOptions options_;
   int fd_{};
   std::atomic<size_t> record_idx_{};
-  std::unordered_map<std::string, std::string> hosts_{};
+  std::unordered_map<std::string, IpAddress> hosts_{};
   std::unordered_map<std::string, std::vector<CallbackFunc>>
       hostname_callbacks_{};
-  std::vector<sockaddr_in> servers_{};
-  LRUCache<std::string, std::string> cache_{300};
+  std::deque<std::pair<std::string, CallbackFunc>> bulk_queue_{};
+  size_t bulk_inflight_{};
+  bool sending_bulk_{};
+  // Outstanding upstream queries, keyed by name.
+  std::unordered_map<std::string, Inflight> inflight_{};
+  uint64_t query_seq_{};
+  std::deque<Waiting> waiting_{};
+  bool pump_scheduled_{};
+  std::vector<Upstream> servers_{};
+  // Canonical name -> address, and alias -> canonical name.
+  AddressCache cache_{300};
+  AliasCache cname_cache_{300};
+  // Canonical name -> NXDOMAIN, or NOERROR for a name without an address.
+  NegativeCache negative_cache_{300};
+  std::unique_ptr<FrequencySketch> sketch_;
+  std::unique_ptr<DnsTcpTransport> tcp_{};
+  // Names being queried over TCP, after truncation or with `force_tcp`.
+  std::unordered_map<std::string, TcpQuery> tcp_queries_{};
 };
 }  // namespace boots
@@ -0,0 +1,154 @@
+#pragma once
+#include <arpa/inet.h>
+#include <sys/socket.h>
+
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+#include "boots/ip_address.h"
+#include "boots/lru_cache.h"
+
+namespace boots {
+class DnsResolver;
+class EventLoop;
+enum class RecordType : uint16_t;
+enum class ResponseCode : uint16_t;
+
+struct DnsServerOptions {
+  std::string address{"127.0.0.1"};
+  uint16_t port{53};
+  // Datagrams moved per recvmmsg()/sendmmsg() call.
+  size_t batch_size{32};
+  // TTL handed out for /etc/hosts entries and literal addresses, which the
+  // resolver never expires.
+  uint32_t local_ttl{60};
+  // TCP clients beyond this many are turned away on accept.
+  size_t max_tcp_connections{256};
+  // A TCP connection that neither sends a query nor is sent an answer for
+  // this long is closed (RFC 7766 6.2.3).
+  std::chrono::milliseconds tcp_idle_timeout{10000};
+  // A relayed question still unanswered after this long gets SERVFAIL.
+  std::chrono::milliseconds relay_timeout{5000};
+};
+
+// A caching DNS forwarder over UDP and TCP for the services on this host.
+//
+// Answers are cached in wire format and served by patching the id, the
+// question and the remaining TTL into a copy, so a hit never re-serializes.
+// A misses are forwarded through the DnsResolver, which also answers from
+// /etc/hosts and shares its cache, negative answers included, with every
+// other user of the resolver. The resolver only looks up A records, so
+// other questions, AAAA among them unless /etc/hosts answers, are relayed
+// as they are to the resolver's servers and their answers passed back.
+class DnsServer : public std::enable_shared_from_this<DnsServer> {
+ public:
+  DnsServer(EventLoop *loop, std::shared_ptr<DnsResolver> resolver,
+            const DnsServerOptions &options = {});
+  ~DnsServer();
+
+  DnsServer(const DnsServer &) = delete;
+  DnsServer &operator=(const DnsServer &) = delete;
+
+  // Binds the UDP and TCP sockets; false if either cannot be bound.
+  bool Init();
+
+ private:
+  struct Answer {
+    // The full response, with a zero id.
+    std::vector<uint8_t> message;
+    // Length of the question section, which hits overwrite with their own.
+    size_t question_size;
+    // Where the record TTLs are, which hits set to the remaining TTL.
+    std::vector<size_t> ttl_offsets;
+  };
+  using AnswerCache = LRUCache<std::string, Answer>;
+  struct Connection;
+  struct Client {
+    sockaddr_storage addr{};
+    bool tcp{};
+    // The query carried an OPT record.
+    bool edns{};
+    // The answer is dropped once the connection closes.
+    std::weak_ptr<Connection> conn{};
+  };
+  struct Question {
+    uint16_t id{};
+    bool rd{};
+    RecordType qtype{};
+    // Lowercased; also the resolver's key.
+    std::string name{};
+    // As received, so that answers keep the client's letter case.
+    std::string wire{};
+  };
+  // A question sent upstream as is, keyed by the id it went out with.
+  struct PendingRelay {
+    Question question;
+    Client client;
+    // Servers yet to answer; a failure from one waits for the others.
+    size_t servers;
+    // Tells a timeout from the relay it was armed for.
+    uint64_t seq;
+  };
+  struct Datagram {
+    sockaddr_storage addr{};
+    std::vector<uint8_t> data{};
+  };
+
+  int Bind(int type);
+  void OnUdp(uint32_t events);
+  void Receive();
+  void FlushUdp();
+  void Accept();
+  void OnTcp(Connection *conn, uint32_t events);
+  bool ReadTcp(Connection *conn);
+  bool FlushTcp(Connection *conn);
+  void CloseTcp(Connection *conn);
+  void ExpireTcp(const std::weak_ptr<Connection> &conn);
+
+  void Handle(std::string_view message, Client client);
+  void Forward(Question question, const Client &client);
+  void Respond(const Question &question, const Client &client,
+               ResponseCode rcode, const IpAddress &ip, uint32_t ttl);
+  void Relay(Question question, const Client &client);
+  void OnRelay();
+  void Relayed(std::string_view message, const sockaddr_in &from);
+  void ExpireRelay(uint16_t id, uint64_t seq);
+  void Store(const Question &question, const std::vector<uint8_t> &message,
+             std::vector<size_t> ttl_offsets, uint32_t ttl);
+  void Reply(const Client &client, std::vector<uint8_t> message);
+  static std::string Key(const Question &question);
+
+  EventLoop *loop_;
+  std::shared_ptr<DnsResolver> resolver_;
+  DnsServerOptions options_;
+  int udp_fd_{-1};
+  int tcp_fd_{-1};
+  // Sends relayed questions to, and reads their answers from, `upstreams_`.
+  int relay_fd_{-1};
+  std::vector<sockaddr_in> upstreams_{};
+  std::unordered_map<uint16_t, PendingRelay> relays_{};
+  uint64_t relay_seq_{};
+  std::vector<char> relay_buf_{};
+  // recvmmsg() and sendmmsg() scratch, `batch_size` slots each, set up once.
+  std::vector<char> rbuf_{};
+  std::vector<sockaddr_storage> raddrs_{};
+  std::vector<iovec> riovs_{};
+  std::vector<mmsghdr> rmsgs_{};
+  std::vector<iovec> siovs_{};
+  std::vector<mmsghdr> smsgs_{};
+  // Answers waiting to go out in one sendmmsg() batch.
+  std::vector<Datagram> udp_out_{};
+  // Answers produced while a batch is read are sent together at its end.
+  bool dispatching_{};
+  bool flush_posted_{};
+  bool udp_blocked_{};
+  std::unordered_map<int, std::shared_ptr<Connection>> conns_{};
+  // Qtype number and lowercased name -> response with a zero id.
+  AnswerCache cache_{300};
+};
+}  // namespace boots
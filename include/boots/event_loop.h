@@ -1,16 +1,52 @@
 #pragma once
+#include <atomic>
 #include <chrono>
 #include <functional>
+#include <tuple>
 #include <unordered_map>
 #include <utility>
+#include <vector>
+
+#include "boots/mpsc_queue.h"
+
+struct epoll_event;
 
 namespace boots {
+
+// Scheduling knobs for latency-critical deployments. The defaults leave
+// placement to the kernel and block in epoll_wait() at once, which costs the
+// least CPU; each option below buys latency with CPU time.
+struct EventLoopOptions {
+  // CPU the thread calling Run() is pinned to; -1 leaves it unpinned.
+  int cpu{-1};
+  // Makes the loop thread allocate from its own NUMA node, so pools it fills
+  // (buffer chunks, caches) stay local even under a process-wide
+  // interleave policy.
+  bool numa_local{false};
+  // Longest single wait when no timer is due sooner.
+  std::chrono::milliseconds poll_interval{10};
+  // Polls without blocking for up to this long before each blocking wait,
+  // saving the wakeup latency of a sleeping thread.
+  std::chrono::microseconds spin_budget{0};
+  // SO_BUSY_POLL for sockets passed to TuneSocket(): how long a read on an
+  // empty socket busy-polls the device queue. Values above
+  // net.core.busy_read need CAP_NET_ADMIN.
+  std::chrono::microseconds busy_poll{0};
+  // Tasks Post()ed from other threads that can wait at once.
+  size_t task_queue_size{4096};
+};
+
 class EventLoop {
 public:
   using CallbackFunc = std::function<void(int, uint32_t)>;
+  using TaskFunc = std::function<void()>;
+  using Clock = std::chrono::steady_clock;
   static uint32_t kPollIn;
+  static uint32_t kPollOut;
   static uint32_t kPollErr;
-  EventLoop();
+  // Peer closed or shut down its write side.
+  static uint32_t kPollHup;
+  explicit EventLoop(const EventLoopOptions &options = {});
   ~EventLoop();
 
   EventLoop(const EventLoop &) = delete;
@@ -19,13 +55,53 @@ public:
   void Add(int fd, uint32_t events, CallbackFunc);
   void Modify(int fd, uint32_t events);
   void Remove(int fd);
+  // Runs `task` on the loop once `delay` has elapsed.
+  void RunAfter(Clock::duration delay, TaskFunc task);
+  // Runs `task` on the loop thread in the next batch. Unlike the rest of the
+  // interface this may be called from any thread; returns false when the
+  // queue is full.
+  bool Post(TaskFunc task);
+  // May be called from any thread.
   void Stop();
   void Run();
 
+  const EventLoopOptions &Options() const { return options_; }
+  // Applies the socket-level options to `fd`: busy polling, and for a pinned
+  // loop SO_INCOMING_CPU so that a SO_REUSEPORT group steers connections
+  // to the listener whose loop runs on the receiving CPU.
+  void TuneSocket(int fd) const;
+
 private:
-  bool stopping_{false};
+  struct Timer {
+    Clock::time_point deadline;
+    uint64_t seq;
+    TaskFunc task;
+    // Inverted so that the std heap algorithms keep the earliest on top.
+    bool operator<(const Timer &rhs) const {
+      return std::tie(deadline, seq) > std::tie(rhs.deadline, rhs.seq);
+    }
+  };
+
+  // Wakes a loop blocked in epoll_wait(); only the first caller after it
+  // went to sleep pays for the write.
+  void Wakeup();
+  void RunTasks();
+  int PollTimeout() const;
+  // Waits for events, spinning for up to the spin budget first.
+  int Wait(epoll_event *events, int max_events);
+  void RunTimers();
+  void ApplyPlacement();
+
+  EventLoopOptions options_;
+  std::atomic<bool> stopping_{false};
+  // Set while the loop may block; cleared by whoever wakes it.
+  std::atomic<bool> sleeping_{false};
   int epoll_fd_;
+  int wakeup_fd_;
+  MpscQueue<TaskFunc> tasks_;
   std::unordered_map<int, std::pair<int, CallbackFunc>> fd_handlers_{};
+  std::vector<Timer> timers_{};
+  uint64_t timer_seq_{};
 };
 
 } // namespace boots
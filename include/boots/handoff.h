@@ -0,0 +1,64 @@
+#pragma once
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace boots {
+class EventLoop;
+
+// Passes listening sockets and warm state from a running process to the one
+// replacing it, over a Unix domain socket at a well-known path. Both ends
+// deal only with a peer running as the same user.
+//
+// The successor calls ReceiveHandoff() before opening any socket of its own.
+// The running process keeps a HandoffListener on the path: a successor that
+// connects is sent the fds and data from `provide`, and once it has
+// acknowledged them `handed_over` runs so that this process can stop
+// accepting and drain. The exchange runs on the loop and is abandoned if the
+// successor stalls. The sockets themselves never close, so no connection is
+// refused during the switch.
+class HandoffListener : public std::enable_shared_from_this<HandoffListener> {
+ public:
+  using ProvideFunc =
+      std::function<void(std::vector<int> *fds, std::string *data)>;
+  using TaskFunc = std::function<void()>;
+
+  HandoffListener(EventLoop *loop, std::string path);
+  ~HandoffListener();
+
+  HandoffListener(const HandoffListener &) = delete;
+  HandoffListener &operator=(const HandoffListener &) = delete;
+
+  // Binds `path`, replacing whatever socket file a predecessor left there.
+  bool Init(ProvideFunc provide, TaskFunc handed_over);
+
+ private:
+  struct Session;
+
+  void Accept();
+  void OnSession(uint32_t events);
+  bool SendSession();
+  void EndSession(bool ok);
+  void Close();
+
+  EventLoop *loop_;
+  std::string path_;
+  int fd_{-1};
+  ProvideFunc provide_{};
+  TaskFunc handed_over_{};
+  // The successor being handed over to; one at a time.
+  std::unique_ptr<Session> session_{};
+  uint64_t session_seq_{};
+};
+
+// Takes over from the process listening on `path`. Returns false, with
+// nothing received, when there is none.
+bool ReceiveHandoff(const std::string &path, std::vector<int> *fds,
+                    std::string *data);
+
+// `name` inside a directory only this user can enter: $XDG_RUNTIME_DIR, or
+// else /tmp/boots-<uid>, created with mode 0700. Empty if neither is usable.
+std::string PrivateRuntimePath(const std::string &name);
+
+}  // namespace boots
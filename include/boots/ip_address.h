@@ -0,0 +1,47 @@
+#pragma once
+#include <sys/socket.h>
+
+#include <array>
+#include <cstdint>
+#include <string>
+#include <string_view>
+
+namespace boots {
+
+// An IPv4 or IPv6 address in 16 bytes. IPv4 addresses are kept in their
+// IPv4-mapped IPv6 form (RFC 4291 2.5.5.2), which doubles as the family tag,
+// so values compare as plain bytes and copy without allocating. The
+// all-zero address stands for "no address".
+class IpAddress {
+ public:
+  static constexpr size_t kSize = 16;
+  // Longest text form, without the terminating NUL.
+  static constexpr size_t kMaxTextSize = 45;
+
+  constexpr IpAddress() = default;
+  // `bytes` are in network order: 4 of them for V4, 16 for V6.
+  static IpAddress FromV4(const uint8_t *bytes);
+  static IpAddress FromV6(const uint8_t *bytes);
+  // Parses a literal address. `s` need not be NUL-terminated; hostnames are
+  // turned down before reaching inet_pton().
+  static bool Parse(std::string_view s, IpAddress *ip);
+
+  [[nodiscard]] bool Empty() const { return *this == IpAddress{}; }
+  [[nodiscard]] bool IsV4() const;
+  // AF_INET, AF_INET6, or AF_UNSPEC when empty.
+  [[nodiscard]] int Family() const;
+  [[nodiscard]] const std::array<uint8_t, kSize> &Bytes() const {
+    return bytes_;
+  }
+  // Fills `sa` with this address and `port` (host order). False if empty.
+  bool ToSockaddr(uint16_t port, sockaddr_storage *sa) const;
+  // Dotted quad for IPv4, RFC 5952 text for IPv6, empty for no address.
+  [[nodiscard]] std::string ToString() const;
+
+  bool operator==(const IpAddress &) const = default;
+
+ private:
+  std::array<uint8_t, kSize> bytes_{};
+};
+
+}  // namespace boots
@@ -1,4 +1,5 @@
 #pragma once
+#include <algorithm>
 #include <chrono>
 #include <list>
 #include <unordered_map>
@@ -8,8 +9,9 @@ namespace boots {
 
 template <typename K, typename V> class LRUCache {
 public:
-  using Clock = std::chrono::high_resolution_clock;
+  using Clock = std::chrono::steady_clock;
   using TimePoint = std::chrono::time_point<Clock>;
+  using Duration = Clock::duration;
   struct Pair;
   using ListIt = typename std::list<Pair>::iterator;
 
@@ -17,16 +19,22 @@ public:
     K key;
     V value;
     TimePoint expire;
-    Pair(K key_, V value_, TimePoint expire_)
-        : key{std::move(key_)}, value{std::move(value_)}, expire{expire_} {}
+    Duration ttl;
+    Pair(K key_, V value_, TimePoint expire_, Duration ttl_)
+        : key{std::move(key_)}, value{std::move(value_)}, expire{expire_},
+          ttl{ttl_} {}
   };
 
+  // `seconds` is both the default and the maximum lifetime of an entry.
   LRUCache(size_t seconds) : timeout_{seconds} {}
 
-  void Put(const K &key, const V &value) {
+  void Put(const K &key, const V &value) { Put(key, value, timeout_); }
+
+  void Put(const K &key, const V &value, Duration ttl) {
+    ttl = std::min<Duration>(ttl, timeout_);
     auto it = map_.find(key);
     auto now = Clock::now();
-    list_.emplace_front(key, value, now + timeout_);
+    list_.emplace_front(key, value, now + ttl, ttl);
     if (it != map_.end()) {
       list_.erase(it->second);
       map_.erase(it);
@@ -36,27 +44,51 @@ public:
   }
 
   bool Get(const K &key, V *value) {
+    const Pair *pair = Find(key);
+    if (pair == nullptr) {
+      return false;
+    }
+    *value = pair->value;
+    return true;
+  }
+
+  // Returns the live entry for `key` and marks it most recently used, or
+  // nullptr if it is absent or expired. The pointer is invalidated by the
+  // next mutation of the cache.
+  const Pair *Find(const K &key) {
     auto it = map_.find(key);
     if (it == map_.end()) {
-      return false;
+      return nullptr;
     }
 
     auto now = Clock::now();
-    it->second->expire = now + timeout_;
+    if (it->second->expire <= now) {
+      list_.erase(it->second);
+      map_.erase(it);
+      return nullptr;
+    }
     list_.splice(list_.begin(), list_, it->second);
     expire(now);
-    return true;
+    return &*list_.begin();
   }
 
   bool Exists(const K &key) const { return map_.find(key) != map_.end(); }
 
-  bool Size() const { return map_.size(); }
+  size_t Size() const { return map_.size(); }
+
+  // Visits every entry, expired ones included, from least to most recently
+  // used, so that Put()ting them in order rebuilds the same recency.
+  template <typename F> void ForEach(F &&visit) const {
+    for (auto it = list_.rbegin(); it != list_.rend(); ++it) {
+      visit(*it);
+    }
+  }
 
 private:
   void expire(TimePoint now) {
     while (!list_.empty()) {
       auto &back = *list_.rbegin();
-      if (back.expire < now) {
+      if (back.expire > now) {
         break;
       }
       map_.erase(back.key);
@@ -0,0 +1,91 @@
+#pragma once
+#include <algorithm>
+#include <atomic>
+#include <bit>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <utility>
+
+namespace boots {
+
+// Bounded lock-free queue for many producers and one consumer, after
+// Dmitry Vyukov's bounded MPMC queue. Each cell carries a sequence number
+// telling whose turn it is, so producers only contend on one CAS of the
+// tail and the consumer needs no atomic read-modify-write at all.
+template <typename T> class MpscQueue {
+public:
+  // `capacity` is rounded up to a power of two.
+  explicit MpscQueue(size_t capacity)
+      : mask_{std::bit_ceil(std::max<size_t>(capacity, 2)) - 1},
+        cells_{std::make_unique<Cell[]>(mask_ + 1)} {
+    for (size_t i = 0; i <= mask_; ++i) {
+      cells_[i].seq.store(i, std::memory_order_relaxed);
+    }
+  }
+
+  MpscQueue(const MpscQueue &) = delete;
+  MpscQueue &operator=(const MpscQueue &) = delete;
+
+  // Safe from any thread. Returns false, leaving `value` untouched, when the
+  // queue is full.
+  bool Push(T &&value) {
+    size_t pos = tail_.load(std::memory_order_relaxed);
+    Cell *cell{};
+    for (;;) {
+      cell = &cells_[pos & mask_];
+      size_t seq = cell->seq.load(std::memory_order_acquire);
+      auto diff = static_cast<intptr_t>(seq) - static_cast<intptr_t>(pos);
+      if (diff == 0) {
+        if (tail_.compare_exchange_weak(pos, pos + 1,
+                                        std::memory_order_relaxed)) {
+          break;
+        }
+      } else if (diff < 0) {
+        return false;
+      } else {
+        pos = tail_.load(std::memory_order_relaxed);
+      }
+    }
+    cell->value = std::move(value);
+    cell->seq.store(pos + 1, std::memory_order_release);
+    return true;
+  }
+
+  // Consumer thread only.
+  bool Pop(T *value) {
+    Cell &cell = cells_[head_ & mask_];
+    if (cell.seq.load(std::memory_order_acquire) != head_ + 1) {
+      return false;
+    }
+    *value = std::move(cell.value);
+    // Drops whatever the moved-from value still holds before the slot is
+    // handed back to producers.
+    cell.value = T{};
+    cell.seq.store(head_ + mask_ + 1, std::memory_order_release);
+    ++head_;
+    return true;
+  }
+
+  // Consumer thread only.
+  bool Empty() const {
+    return cells_[head_ & mask_].seq.load(std::memory_order_acquire) !=
+           head_ + 1;
+  }
+
+  size_t Capacity() const { return mask_ + 1; }
+
+private:
+  struct Cell {
+    std::atomic<size_t> seq;
+    T value;
+  };
+
+  const size_t mask_;
+  std::unique_ptr<Cell[]> cells_;
+  // Producers and the consumer write different cache lines.
+  alignas(64) std::atomic<size_t> tail_{0};
+  alignas(64) size_t head_{0};
+};
+
+} // namespace boots
@@ -0,0 +1,94 @@
+#pragma once
+#include <arpa/inet.h>
+
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+
+#include "boots/upstream_pool.h"
+
+namespace boots {
+class ChunkPool;
+class DnsResolver;
+class EventLoop;
+
+struct TcpRelayOptions {
+  enum class Mode : uint8_t {
+    // Every connection goes to `target_host`:`target_port`.
+    kForward,
+    // Clients name their target in a SOCKS5 or HTTP CONNECT handshake.
+    kSocks5,
+    kHttpConnect,
+  };
+  Mode mode{Mode::kForward};
+  std::string target_host{};
+  uint16_t target_port{};
+  // Connections to the target kept open ahead of demand.
+  size_t prewarm_connections{};
+  UpstreamPoolOptions pool{};
+  // Copies through user-space buffers instead of splice(), for when the
+  // stream has to be inspected or transformed.
+  bool use_splice{true};
+  // Per direction: reading stops at the high watermark and resumes once the
+  // buffer drains to the low one.
+  size_t high_watermark{256 * 1024};
+  size_t low_watermark{64 * 1024};
+  // Free bytes kept in front of buffered data for protocol headers.
+  size_t buffer_headroom{64};
+  // Adopts a bound, listening socket, e.g. one handed over by the process
+  // being replaced, instead of opening one on `port`.
+  int listen_fd{-1};
+};
+
+class TcpRelay : public std::enable_shared_from_this<TcpRelay> {
+ public:
+  TcpRelay(EventLoop *loop, std::shared_ptr<DnsResolver> resolver,
+           uint16_t port, const TcpRelayOptions &options);
+  ~TcpRelay();
+
+  TcpRelay(const TcpRelay &) = delete;
+  TcpRelay &operator=(const TcpRelay &) = delete;
+
+  void Init();
+  [[nodiscard]] int ListenFd() const { return fd_; }
+  // Stops accepting and calls `drained` once the last session has closed.
+  void Shutdown(std::function<void()> drained);
+
+ private:
+  struct Session;
+
+  void Accept();
+  void Handshake(Session *session);
+  bool SendReply(Session *session, std::string_view reply);
+  void Resolve(const std::shared_ptr<Session> &session, const std::string &host,
+               uint16_t port);
+  void Connect(const std::shared_ptr<Session> &session);
+  void Start(const std::shared_ptr<Session> &session, int upstream);
+  void OnEvent(Session *session, int fd, uint32_t events);
+  bool Transfer(Session *session, int dir);
+  bool Drain(Session *session, int dir);
+  void UpdateInterest(Session *session);
+  // Bytes read in direction `dir` but not yet written out.
+  size_t Buffered(const Session *session, int dir) const;
+  // Sends `refusal` first if the client is in a proxy handshake.
+  void Fail(Session *session, std::string_view refusal);
+  void Close(Session *session);
+  void ResolveTarget(const std::string &host, uint16_t port,
+                     std::function<void(const sockaddr_storage *addr,
+                                        const std::string &error)>
+                         callback);
+
+  EventLoop *loop_;
+  std::shared_ptr<DnsResolver> resolver_;
+  TcpRelayOptions options_;
+  int fd_;
+  std::shared_ptr<UpstreamPool> pool_;
+  std::unique_ptr<ChunkPool> chunk_pool_;
+  // Keyed by client fd.
+  std::unordered_map<int, std::shared_ptr<Session>> sessions_{};
+  std::function<void()> drained_{};
+};
+}  // namespace boots
@@ -0,0 +1,81 @@
+#pragma once
+#include <arpa/inet.h>
+
+#include <chrono>
+#include <functional>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+namespace boots {
+class EventLoop;
+
+struct UpstreamPoolOptions {
+  // Idle connections older than this are closed, except the newest ones
+  // that a Prewarm() count keeps.
+  std::chrono::seconds idle_timeout{30};
+  size_t max_idle_per_target{16};
+  size_t max_idle_total{256};
+  std::chrono::seconds connect_timeout{5};
+};
+
+// Per-loop pool of connected upstream sockets keyed by resolved address.
+// Idle sockets stay registered with the loop so that a peer close or stray
+// data (EPOLLRDHUP/EPOLLIN) evicts them at once; a MSG_PEEK probe checks them
+// again right before they are handed out.
+class UpstreamPool : public std::enable_shared_from_this<UpstreamPool> {
+ public:
+  using ConnectFunc = std::function<void(int fd, const std::string &error)>;
+
+  UpstreamPool(EventLoop *loop, const UpstreamPoolOptions &options = {});
+  ~UpstreamPool();
+
+  UpstreamPool(const UpstreamPool &) = delete;
+  UpstreamPool &operator=(const UpstreamPool &) = delete;
+
+  void Init();
+  // Hands out a live idle connection to `addr` or starts a new one. The
+  // callback owns the fd, which is no longer registered with the loop.
+  void Acquire(const sockaddr_storage &addr, ConnectFunc callback);
+  // Returns a connection that carries no unread or in-flight data.
+  void Release(const sockaddr_storage &addr, int fd);
+  // Connects until `count` idle connections to `addr` are available.
+  void Prewarm(const sockaddr_storage &addr, size_t count);
+
+  [[nodiscard]] size_t IdleCount() const { return idle_total_; }
+
+ private:
+  using Clock = std::chrono::steady_clock;
+  struct Idle {
+    int fd;
+    Clock::time_point since;
+  };
+  struct Target {
+    sockaddr_storage addr{};
+    // Most recently released last, so reuse is LIFO and the oldest expire.
+    std::vector<Idle> idle{};
+    size_t connecting{};
+    size_t prewarm{};
+  };
+
+  void Connect(Target *target, ConnectFunc callback);
+  void Park(Target *target, int fd);
+  void Evict(int fd);
+  void Sweep();
+  Target *GetTarget(const sockaddr_storage &addr);
+
+  static std::string Key(const sockaddr_storage &addr);
+  static bool IsAlive(int fd);
+
+  EventLoop *loop_;
+  UpstreamPoolOptions options_;
+  std::unordered_map<std::string, Target> targets_{};
+  // Idle fd -> key of its target.
+  std::unordered_map<int, std::string> idle_keys_{};
+  // Sockets still connecting, closed with the pool.
+  std::unordered_set<int> connecting_fds_{};
+  size_t idle_total_{};
+};
+}  // namespace boots
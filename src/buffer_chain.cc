@@ -0,0 +1,244 @@
+#include "buffer_chain.h"
+
+#include <sys/uio.h>
+
+#include <algorithm>
+#include <array>
+#include <cstring>
+#include <new>
+
+namespace boots {
+
+// Slices gathered per writev(2); far below IOV_MAX but enough to drain a
+// high watermark's worth of 16K chunks in one call.
+static constexpr size_t kMaxIov = 64;
+// Fresh chunks offered to each readv(2) besides the tail room.
+static constexpr size_t kReadChunks = 2;
+
+ChunkRef::~ChunkRef() {
+  if (chunk_ != nullptr && --chunk_->refs == 0) {
+    chunk_->pool->Recycle(chunk_);
+  }
+}
+
+ChunkPool::ChunkPool(size_t chunk_size, size_t max_free)
+    : chunk_size_{chunk_size}, max_free_{max_free} {}
+
+ChunkPool::~ChunkPool() {
+  for (Chunk *chunk : free_) {
+    ::operator delete(chunk);
+  }
+}
+
+ChunkRef ChunkPool::Acquire() {
+  Chunk *chunk{};
+  if (!free_.empty()) {
+    chunk = free_.back();
+    free_.pop_back();
+  } else {
+    chunk = static_cast<Chunk *>(::operator new(sizeof(Chunk) + chunk_size_));
+  }
+  chunk->pool = this;
+  chunk->refs = 1;
+  return ChunkRef{chunk};
+}
+
+void ChunkPool::Recycle(Chunk *chunk) {
+  if (free_.size() < max_free_) {
+    free_.push_back(chunk);
+    return;
+  }
+  ::operator delete(chunk);
+}
+
+ssize_t BufferChain::ReadFrom(int fd, size_t max) {
+  std::array<iovec, kReadChunks + 1> iov{};
+  std::array<ChunkRef, kReadChunks> fresh{};
+  std::array<uint32_t, kReadChunks> fresh_begin{};
+  size_t cnt = 0;
+  size_t total = 0;
+  size_t room = std::min(TailRoom(), max);
+  if (room > 0) {
+    Span &tail = spans_.back();
+    iov[cnt++] = {tail.chunk->Data() + tail.end, room};
+    total += room;
+  }
+  for (size_t i = 0; i < kReadChunks && total < max; ++i) {
+    fresh[i] = pool_->Acquire();
+    // Headroom is reserved only at the very front of the data.
+    fresh_begin[i] = size_ == 0 && cnt == 0 ? headroom_ : 0;
+    size_t len = std::min(pool_->Size() - fresh_begin[i], max - total);
+    iov[cnt++] = {fresh[i]->Data() + fresh_begin[i], len};
+    total += len;
+  }
+
+  auto n = readv(fd, iov.data(), static_cast<int>(cnt));
+  if (n <= 0) {
+    return n;
+  }
+  size_ += n;
+  size_t left = n;
+  size_t idx = 0;
+  if (room > 0) {
+    size_t len = std::min(left, iov[idx++].iov_len);
+    spans_.back().end += len;
+    left -= len;
+  }
+  for (size_t i = 0; left > 0; ++i, ++idx) {
+    size_t len = std::min(left, iov[idx].iov_len);
+    spans_.push_back({std::move(fresh[i]), fresh_begin[i],
+                      static_cast<uint32_t>(fresh_begin[i] + len)});
+    left -= len;
+  }
+  return n;
+}
+
+ssize_t BufferChain::WriteTo(int fd) {
+  std::array<iovec, kMaxIov> iov{};
+  size_t cnt = 0;
+  for (size_t i = head_; i < spans_.size() && cnt < kMaxIov; ++i) {
+    Span &span = spans_[i];
+    iov[cnt++] = {span.chunk->Data() + span.begin, span.Size()};
+  }
+  if (cnt == 0) {
+    return 0;
+  }
+  auto n = writev(fd, iov.data(), static_cast<int>(cnt));
+  if (n > 0) {
+    Consume(n);
+  }
+  return n;
+}
+
+void BufferChain::Append(std::string_view data) {
+  while (!data.empty()) {
+    size_t room = TailRoom();
+    if (room == 0) {
+      PushChunk(size_ == 0 ? headroom_ : 0);
+      room = TailRoom();
+    }
+    size_t len = std::min(room, data.size());
+    Span &tail = spans_.back();
+    memcpy(tail.chunk->Data() + tail.end, data.data(), len);
+    tail.end += len;
+    size_ += len;
+    data.remove_prefix(len);
+  }
+}
+
+void BufferChain::Append(const BufferChain &other) {
+  for (size_t i = other.head_; i < other.spans_.size(); ++i) {
+    spans_.push_back(other.spans_[i]);
+  }
+  size_ += other.size_;
+}
+
+void BufferChain::Prepend(std::string_view data) {
+  if (head_ < spans_.size()) {
+    Span &front = spans_[head_];
+    if (front.chunk.Unique() && front.begin >= data.size()) {
+      front.begin -= data.size();
+      memcpy(front.chunk->Data() + front.begin, data.data(), data.size());
+      size_ += data.size();
+      return;
+    }
+  }
+  // Fills new chunks back to front, leaving their free space in front as
+  // headroom for further prepends.
+  while (!data.empty()) {
+    size_t len = std::min(pool_->Size(), data.size());
+    auto begin = static_cast<uint32_t>(pool_->Size() - len);
+    Span span{pool_->Acquire(), begin, static_cast<uint32_t>(pool_->Size())};
+    memcpy(span.chunk->Data() + begin, data.data() + data.size() - len, len);
+    if (head_ > 0) {
+      spans_[--head_] = std::move(span);
+    } else {
+      spans_.insert(spans_.begin(), std::move(span));
+    }
+    size_ += len;
+    data.remove_suffix(len);
+  }
+}
+
+BufferChain BufferChain::Slice(size_t offset, size_t len) const {
+  BufferChain res{pool_};
+  for (size_t i = head_; i < spans_.size() && len > 0; ++i) {
+    const Span &span = spans_[i];
+    if (offset >= span.Size()) {
+      offset -= span.Size();
+      continue;
+    }
+    size_t take = std::min(span.Size() - offset, len);
+    auto begin = static_cast<uint32_t>(span.begin + offset);
+    res.spans_.push_back(
+        {span.chunk, begin, static_cast<uint32_t>(begin + take)});
+    res.size_ += take;
+    len -= take;
+    offset = 0;
+  }
+  return res;
+}
+
+size_t BufferChain::Peek(size_t offset, void *out, size_t len) const {
+  auto *dst = static_cast<uint8_t *>(out);
+  size_t copied = 0;
+  for (size_t i = head_; i < spans_.size() && copied < len; ++i) {
+    const Span &span = spans_[i];
+    if (offset >= span.Size()) {
+      offset -= span.Size();
+      continue;
+    }
+    size_t take = std::min(span.Size() - offset, len - copied);
+    memcpy(dst + copied, span.chunk->Data() + span.begin + offset, take);
+    copied += take;
+    offset = 0;
+  }
+  return copied;
+}
+
+void BufferChain::Consume(size_t len) {
+  len = std::min(len, size_);
+  size_ -= len;
+  while (len > 0) {
+    Span &front = spans_[head_];
+    size_t take = std::min(front.Size(), len);
+    front.begin += take;
+    len -= take;
+    if (front.Size() == 0) {
+      // Returns the chunk to the pool right away.
+      front.chunk = {};
+      ++head_;
+    }
+  }
+  if (head_ == spans_.size()) {
+    spans_.clear();
+    head_ = 0;
+  } else if (head_ > 16 && head_ * 2 > spans_.size()) {
+    spans_.erase(spans_.begin(), spans_.begin() + head_);
+    head_ = 0;
+  }
+}
+
+void BufferChain::Clear() {
+  spans_.clear();
+  head_ = 0;
+  size_ = 0;
+}
+
+size_t BufferChain::TailRoom() const {
+  if (head_ == spans_.size()) {
+    return 0;
+  }
+  const Span &tail = spans_.back();
+  if (!tail.chunk.Unique()) {
+    return 0;
+  }
+  return pool_->Size() - tail.end;
+}
+
+void BufferChain::PushChunk(size_t begin) {
+  auto offset = static_cast<uint32_t>(std::min(begin, pool_->Size()));
+  spans_.push_back({pool_->Acquire(), offset, offset});
+}
+
+}  // namespace boots
@@ -0,0 +1,116 @@
+#pragma once
+#include <sys/types.h>
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+namespace boots {
+class ChunkPool;
+
+// Fixed-size block of bytes; the header is followed by `ChunkPool::Size()`
+// bytes of data. Refcounts are plain integers: a chunk never leaves the loop
+// that owns its pool.
+struct Chunk {
+  ChunkPool *pool;
+  uint32_t refs;
+
+  uint8_t *Data() { return reinterpret_cast<uint8_t *>(this + 1); }
+};
+
+class ChunkRef {
+ public:
+  ChunkRef() = default;
+  explicit ChunkRef(Chunk *chunk) : chunk_{chunk} {}
+  ChunkRef(const ChunkRef &rhs) : chunk_{rhs.chunk_} {
+    if (chunk_ != nullptr) ++chunk_->refs;
+  }
+  ChunkRef(ChunkRef &&rhs) noexcept : chunk_{std::exchange(rhs.chunk_, {})} {}
+  ChunkRef &operator=(ChunkRef rhs) noexcept {
+    std::swap(chunk_, rhs.chunk_);
+    return *this;
+  }
+  ~ChunkRef();
+
+  Chunk *operator->() const { return chunk_; }
+  explicit operator bool() const { return chunk_ != nullptr; }
+  [[nodiscard]] bool Unique() const { return chunk_->refs == 1; }
+
+ private:
+  Chunk *chunk_{};
+};
+
+// Per-loop free list of chunks, so steady-state traffic does not allocate.
+class ChunkPool {
+ public:
+  explicit ChunkPool(size_t chunk_size = 16 * 1024, size_t max_free = 1024);
+  ~ChunkPool();
+
+  ChunkPool(const ChunkPool &) = delete;
+  ChunkPool &operator=(const ChunkPool &) = delete;
+
+  ChunkRef Acquire();
+  [[nodiscard]] size_t Size() const { return chunk_size_; }
+
+ private:
+  friend class ChunkRef;
+  void Recycle(Chunk *chunk);
+
+  size_t chunk_size_;
+  size_t max_free_;
+  std::vector<Chunk *> free_{};
+};
+
+// Byte queue made of slices of pooled chunks. Slicing shares chunks instead
+// of copying, and chunks go back to the pool as soon as they are consumed,
+// so an empty chain holds no buffer memory.
+class BufferChain {
+ public:
+  // `headroom` bytes are left free in front of the first read or append.
+  explicit BufferChain(ChunkPool *pool, size_t headroom = 0)
+      : pool_{pool}, headroom_{std::min(headroom, pool->Size() / 2)} {}
+
+  [[nodiscard]] size_t Size() const { return size_; }
+  [[nodiscard]] bool Empty() const { return size_ == 0; }
+
+  // Scatter-reads up to `max` bytes from `fd`. Returns read(2)'s result.
+  ssize_t ReadFrom(int fd, size_t max);
+  // Gathers as many slices as possible into one writev(2) and consumes what
+  // was written. Returns writev(2)'s result.
+  ssize_t WriteTo(int fd);
+
+  void Append(std::string_view data);
+  void Append(const BufferChain &other);
+  // Writes in front of the data, using the headroom reserved by the first
+  // read when possible.
+  void Prepend(std::string_view data);
+  // Shares the bytes in [offset, offset + len) without copying them.
+  [[nodiscard]] BufferChain Slice(size_t offset, size_t len) const;
+  // Copies up to `len` bytes starting at `offset`; returns the count.
+  size_t Peek(size_t offset, void *out, size_t len) const;
+  void Consume(size_t len);
+  void Clear();
+
+ private:
+  struct Span {
+    ChunkRef chunk;
+    uint32_t begin;
+    uint32_t end;
+    [[nodiscard]] size_t Size() const { return end - begin; }
+  };
+
+  // Free bytes after the last span, if its chunk can be written.
+  size_t TailRoom() const;
+  void PushChunk(size_t begin);
+
+  ChunkPool *pool_;
+  size_t headroom_;
+  // Consumed spans before `head_` are compacted away lazily.
+  std::vector<Span> spans_{};
+  size_t head_{};
+  size_t size_{};
+};
+}  // namespace boots
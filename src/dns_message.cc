@@ -2,51 +2,136 @@
 
 #include <arpa/inet.h>
 
+#if defined(__SSE2__) || defined(__AVX2__)
+#include <immintrin.h>
+#endif
+
+#include <algorithm>
+#include <array>
+#include <bit>
 #include <cstring>
 
 #include "util.h"
 
 namespace boots {
 
-static const char *IP_DOT_DELIMITER = ".";
-
 size_t ParseName(std::string_view s, size_t offset, std::string *name);
-std::string ParseIp(RecordType record_type, std::string_view data,
-                    size_t offset, size_t length);
+std::string ParseRdata(RecordType record_type, std::string_view data,
+                       size_t offset, size_t length);
+
+namespace {
+
+// Fixed query header: RD set, one question. Only the id varies per request.
+constexpr auto kQueryHeader = [] {
+  HeaderSection header{};
+  header.flags.rd = true;
+  header.questions = 1;
+  std::array<uint8_t, HeaderSection::kSize> bytes{};
+  header.Pack(bytes.data());
+  return bytes;
+}();
+
+constexpr size_t kQuestionTailSize = sizeof(RecordType) + sizeof(RecordClass);
+
+// OPT pseudo-RR (RFC 6891): root name, TYPE=41, CLASS=payload size (patched
+// per query), extended RCODE, version and flags all zero, no options.
+constexpr std::array<uint8_t, 11> kOptRecord{
+    0, 0, static_cast<uint8_t>(RecordType::OPT), 0, 0, 0, 0, 0, 0, 0, 0};
+constexpr uint16_t kMinEdnsPayloadSize = 512;
+
+constexpr size_t kMaxQuerySize = HeaderSection::kSize + kMaxNameSize +
+                                 kQuestionTailSize + kOptRecord.size();
+
+// Tracks the start of the current label while dots are reported in order.
+// `out[i + 1]` mirrors `name[i]`, so the length byte of a label starting at
+// `name[start]` lives at `out[start]`, overwriting the preceding dot.
+struct LabelWriter {
+  uint8_t *out;
+  size_t start{};
+  bool ok{true};
+
+  void Close(size_t end) {
+    size_t len = end - start;
+    ok &= len > 0 && len <= kMaxLabelSize;
+    out[start] = static_cast<uint8_t>(len);
+    start = end + 1;
+  }
+};
+
+size_t CopyAndScanDots(std::string_view name, uint8_t *out, LabelWriter *w) {
+  const char *src = name.data();
+  size_t n = name.size();
+  size_t i = 0;
+#if defined(__AVX2__)
+  const __m256i dots32 = _mm256_set1_epi8('.');
+  for (; i + 32 <= n; i += 32) {
+    __m256i chunk =
+        _mm256_loadu_si256(reinterpret_cast<const __m256i *>(src + i));
+    _mm256_storeu_si256(reinterpret_cast<__m256i *>(out + 1 + i), chunk);
+    auto mask = static_cast<uint32_t>(
+        _mm256_movemask_epi8(_mm256_cmpeq_epi8(chunk, dots32)));
+    for (; mask != 0; mask &= mask - 1) {
+      w->Close(i + std::countr_zero(mask));
+    }
+  }
+#endif
+#if defined(__SSE2__)
+  const __m128i dots16 = _mm_set1_epi8('.');
+  for (; i + 16 <= n; i += 16) {
+    __m128i chunk = _mm_loadu_si128(reinterpret_cast<const __m128i *>(src + i));
+    _mm_storeu_si128(reinterpret_cast<__m128i *>(out + 1 + i), chunk);
+    auto mask = static_cast<uint32_t>(
+        _mm_movemask_epi8(_mm_cmpeq_epi8(chunk, dots16)));
+    for (; mask != 0; mask &= mask - 1) {
+      w->Close(i + std::countr_zero(mask));
+    }
+  }
+#endif
+  for (; i < n; ++i) {
+    out[1 + i] = static_cast<uint8_t>(src[i]);
+    if (src[i] == '.') {
+      w->Close(i);
+    }
+  }
+  return n;
+}
+
+void WriteOptRecord(uint16_t payload_size, uint8_t *out) {
+  memcpy(out, kOptRecord.data(), kOptRecord.size());
+  // The OPT class field carries the sender's UDP payload size.
+  str::StoreBigEndian(std::max(payload_size, kMinEdnsPayloadSize), out + 3);
+}
+
+}  // namespace
 
 HeaderSection HeaderSection::BuildRequest() {
   HeaderSection header{true};
   header.questions = 1;
-  header.flags.ra = 1;
+  header.flags.rd = true;
   return header;
 }
 
 size_t HeaderSection::Deserialize(std::string_view s, bool *ok) {
-  if (s.size() < sizeof(HeaderSection)) {
+  if (s.size() < kSize) {
     *ok = false;
     return 0;
   }
 
-  memcpy(this, s.data(), sizeof(HeaderSection));
-  SwapSelf();
+  const auto *p = reinterpret_cast<const uint8_t *>(s.data());
+  request_id = str::LoadBigEndian<uint16_t>(p);
+  flags = Flags::Unpack(str::LoadBigEndian<uint16_t>(p + 2));
+  questions = str::LoadBigEndian<uint16_t>(p + 4);
+  answer_rr = str::LoadBigEndian<uint16_t>(p + 6);
+  authority_rr = str::LoadBigEndian<uint16_t>(p + 8);
+  additional_rr = str::LoadBigEndian<uint16_t>(p + 10);
   *ok = true;
-  return sizeof(HeaderSection);
+  return kSize;
 }
 
-void HeaderSection::Serialize(std::vector<uint8_t> *s) {
+void HeaderSection::Serialize(std::vector<uint8_t> *s) const {
   auto len = s->size();
-  s->resize(s->size() + sizeof(HeaderSection));
-  SwapSelf();
-  memcpy(s->data() + len, this, sizeof(HeaderSection));
-}
-
-void HeaderSection::SwapSelf() {
-  str::InplaceSwap(&request_id);
-  str::InplaceSwap(&flags);
-  str::InplaceSwap(&questions);
-  str::InplaceSwap(&answer_rr);
-  str::InplaceSwap(&authority_rr);
-  str::InplaceSwap(&additional_rr);
+  s->resize(len + kSize);
+  Pack(s->data() + len);
 }
 
 QuestionSection QuestionSection::BuildRequest(const std::string &hostname) {
@@ -59,6 +144,9 @@ QuestionSection QuestionSection::BuildRequest(const std::string &hostname) {
 
 size_t QuestionSection::Deserialize(std::string_view data, size_t offset) {
   size_t name_len = ParseName(data, offset, &qname);
+  if (name_len == 0 || data.size() - offset - name_len < sizeof(bin)) {
+    return 0;
+  }
   std::string_view s = data.substr(offset + name_len);
   memcpy(&bin, s.data(), sizeof(bin));
   str::InplaceSwap(&bin.qtype);
@@ -66,64 +154,248 @@ size_t QuestionSection::Deserialize(std::string_view data, size_t offset) {
   return name_len + sizeof(bin);
 }
 
-void QuestionSection::Serialize(std::vector<uint8_t> *v) {
-  v->reserve(v->size() + qname.size() + 2 + sizeof(bin));
-  auto segments = str::Split(str::Trim(qname), IP_DOT_DELIMITER);
-  for (auto &segment : segments) {
-    v->push_back(static_cast<uint8_t>(segment.size()));
-    v->insert(v->end(), segment.begin(), segment.end());
+void QuestionSection::Serialize(std::vector<uint8_t> *v) const {
+  std::array<uint8_t, kMaxNameSize + kQuestionTailSize> buf;
+  size_t len = EncodeName(str::Trim(qname), buf.data());
+  if (len == 0) {
+    return;
   }
-  v->push_back(0);
+  str::StoreBigEndian(bin.qtype, buf.data() + len);
+  str::StoreBigEndian(bin.qclass, buf.data() + len + sizeof(bin.qtype));
+  v->insert(v->end(), buf.begin(), buf.begin() + len + kQuestionTailSize);
+}
 
-  str::InplaceSwap(&bin.qtype);
-  str::InplaceSwap(&bin.qclass);
-  auto len = v->size();
-  v->resize(v->size() + sizeof(bin));
-  memcpy(v->data() + len, &bin.qtype, sizeof(bin.qtype));
-  len += sizeof(bin.qtype);
-  memcpy(v->data() + len, &bin.qclass, sizeof(bin.qclass));
+size_t EncodeName(std::string_view name, uint8_t *out) {
+  if (!name.empty() && name.back() == '.') {
+    name.remove_suffix(1);
+  }
+  if (name.empty()) {
+    out[0] = 0;
+    return 1;
+  }
+  // One length byte per label replaces each dot, plus the leading length
+  // byte and the root terminator.
+  if (name.size() + 2 > kMaxNameSize) {
+    return 0;
+  }
+
+  LabelWriter writer{out};
+  size_t n = CopyAndScanDots(name, out, &writer);
+  writer.Close(n);
+  out[n + 1] = 0;
+  return writer.ok ? n + 2 : 0;
 }
 
 size_t RecordSection::Deserialize(std::string_view data, size_t offset) {
   size_t name_len = ParseName(data, offset, &name);
+  if (name_len == 0 || data.size() - offset - name_len < sizeof(bin)) {
+    return 0;
+  }
   std::string_view s = data.substr(offset + name_len);
   memcpy(&bin, s.data(), sizeof(bin));
   str::InplaceSwap(&bin.type);
   str::InplaceSwap(&bin.clazz);
   str::InplaceSwap(&bin.ttl);
   str::InplaceSwap(&bin.rdlength);
-  ip = ParseIp(bin.type, data, offset + name_len + sizeof(bin), bin.rdlength);
+  if (s.size() - sizeof(bin) < bin.rdlength) {
+    return 0;
+  }
+  size_t rdata_offset = offset + name_len + sizeof(bin);
+  const auto *rdata_bytes =
+      reinterpret_cast<const uint8_t *>(data.data() + rdata_offset);
+  if (bin.type == RecordType::A && bin.rdlength == 4) {
+    ip = IpAddress::FromV4(rdata_bytes);
+  } else if (bin.type == RecordType::AAAA && bin.rdlength == IpAddress::kSize) {
+    ip = IpAddress::FromV6(rdata_bytes);
+  } else if (bin.type != RecordType::A && bin.type != RecordType::AAAA) {
+    rdata = ParseRdata(bin.type, data, rdata_offset, bin.rdlength);
+  }
   return name_len + sizeof(bin) + bin.rdlength;
 }
 
-std::vector<uint8_t> SerializeDnsRequest(const std::string &hostname) {
-  std::vector<uint8_t> res{};
-  HeaderSection header{HeaderSection::BuildRequest()};
-  header.Serialize(&res);
+bool IsValidHostname(std::string_view name) {
+  std::array<uint8_t, kMaxNameSize> buf;
+  return EncodeName(name, buf.data()) != 0;
+}
+
+std::vector<uint8_t> SerializeDnsRequest(const std::string &hostname,
+                                         uint16_t edns_payload_size) {
+  std::array<uint8_t, kMaxQuerySize> buf;
+  memcpy(buf.data(), kQueryHeader.data(), kQueryHeader.size());
+  str::StoreBigEndian(static_cast<uint16_t>(rand()), buf.data());
+
+  uint8_t *cur = buf.data() + HeaderSection::kSize;
+  size_t name_len = EncodeName(hostname, cur);
+  if (name_len == 0) {
+    return {};
+  }
+  cur += name_len;
+  str::StoreBigEndian(RecordType::A, cur);
+  str::StoreBigEndian(RecordClass::kIn, cur + sizeof(RecordType));
+  cur += kQuestionTailSize;
 
-  QuestionSection question{QuestionSection::BuildRequest(hostname)};
-  question.Serialize(&res);
-  return res;
+  if (edns_payload_size != 0) {
+    // ARCOUNT sits in the last two bytes of the header.
+    str::StoreBigEndian(uint16_t{1}, buf.data() + HeaderSection::kSize - 2);
+    WriteOptRecord(edns_payload_size, cur);
+    cur += kOptRecord.size();
+  }
+  return {buf.data(), cur};
+}
+
+std::vector<uint8_t> SerializeDnsResponse(uint16_t request_id, bool rd,
+                                          std::string_view question,
+                                          ResponseCode rcode,
+                                          const IpAddress &ip, uint32_t ttl) {
+  HeaderSection header{};
+  header.request_id = request_id;
+  header.flags.qr = true;
+  header.flags.rd = rd;
+  header.flags.ra = true;
+  header.flags.rcode = static_cast<uint8_t>(rcode);
+  header.questions = question.empty() ? 0 : 1;
+  header.answer_rr = ip.Empty() ? 0 : 1;
+
+  // Pointer to the question name, type, class, TTL, RDLENGTH, RDATA.
+  constexpr size_t kMaxAnswerSize =
+      kAnswerTtlOffset + sizeof(uint32_t) + sizeof(uint16_t) + IpAddress::kSize;
+  std::vector<uint8_t> message(HeaderSection::kSize + question.size() +
+                               (ip.Empty() ? 0 : kMaxAnswerSize));
+  header.Pack(message.data());
+  memcpy(message.data() + HeaderSection::kSize, question.data(),
+         question.size());
+  if (ip.Empty()) {
+    return message;
+  }
+  uint8_t *cur = message.data() + HeaderSection::kSize + question.size();
+  str::StoreBigEndian(uint16_t{0xC000 | HeaderSection::kSize}, cur);
+  bool v4 = ip.IsV4();
+  str::StoreBigEndian(v4 ? RecordType::A : RecordType::AAAA, cur + 2);
+  str::StoreBigEndian(RecordClass::kIn, cur + 2 + sizeof(RecordType));
+  cur += kAnswerTtlOffset;
+  str::StoreBigEndian(ttl, cur);
+  cur += sizeof(ttl);
+  uint16_t rdlength = v4 ? 4 : IpAddress::kSize;
+  str::StoreBigEndian(rdlength, cur);
+  cur += sizeof(rdlength);
+  memcpy(cur, ip.Bytes().data() + IpAddress::kSize - rdlength, rdlength);
+  message.resize(cur + rdlength - message.data());
+  return message;
+}
+
+bool HasOptRecord(std::string_view message, size_t offset) {
+  if (offset > message.size() || message.size() - offset < kOptRecord.size()) {
+    return false;
+  }
+  const auto *p = reinterpret_cast<const uint8_t *>(message.data()) + offset;
+  return p[0] == 0 && str::LoadBigEndian<RecordType>(p + 1) == RecordType::OPT;
+}
+
+void AppendOptRecord(uint16_t payload_size, std::vector<uint8_t> *message) {
+  uint8_t *arcount = message->data() + HeaderSection::kSize - 2;
+  str::StoreBigEndian(
+      static_cast<uint16_t>(str::LoadBigEndian<uint16_t>(arcount) + 1),
+      arcount);
+  size_t size = message->size();
+  message->resize(size + kOptRecord.size());
+  WriteOptRecord(payload_size, message->data() + size);
+}
+
+bool StripOptRecord(std::vector<uint8_t> *message,
+                    std::vector<size_t> *ttl_offsets) {
+  std::string_view s{reinterpret_cast<const char *>(message->data()),
+                     message->size()};
+  HeaderSection header{};
+  bool ok{};
+  size_t offset{header.Deserialize(s, &ok)};
+  if (!ok) {
+    return false;
+  }
+  for (uint16_t i = 0; i < header.questions; ++i) {
+    QuestionSection question{};
+    size_t n = question.Deserialize(s, offset);
+    if (n == 0) {
+      return false;
+    }
+    offset += n;
+  }
+
+  size_t count = size_t{header.answer_rr} + header.authority_rr +
+                 header.additional_rr;
+  size_t opt_offset{};
+  size_t opt_size{};
+  for (size_t i = 0; i < count; ++i) {
+    RecordSection record{};
+    size_t n = record.Deserialize(s, offset);
+    if (n == 0) {
+      return false;
+    }
+    if (record.bin.type != RecordType::OPT) {
+      // TTL, RDLENGTH and RDATA end the record.
+      ttl_offsets->push_back(offset + n - record.bin.rdlength -
+                             sizeof(uint16_t) - sizeof(int32_t));
+    } else if (opt_size != 0) {
+      return false;
+    } else {
+      opt_offset = offset;
+      opt_size = n;
+    }
+    offset += n;
+  }
+  message->resize(offset);
+  if (opt_size == 0) {
+    return true;
+  }
+  message->erase(message->begin() + opt_offset,
+                 message->begin() + opt_offset + opt_size);
+  for (size_t &ttl_offset : *ttl_offsets) {
+    if (ttl_offset > opt_offset) {
+      ttl_offset -= opt_size;
+    }
+  }
+  uint8_t *arcount = message->data() + HeaderSection::kSize - 2;
+  str::StoreBigEndian(
+      static_cast<uint16_t>(str::LoadBigEndian<uint16_t>(arcount) - 1),
+      arcount);
+  return true;
 }
 
 size_t ParseName(std::string_view s, size_t offset, std::string *name) {
   std::vector<std::string> labels{};
   size_t cur = offset;
-  for (auto i = static_cast<uint8_t>(s[cur]); i > 0;
-       i = static_cast<uint8_t>(s[cur])) {
+  for (;;) {
+    if (cur >= s.size()) {
+      return 0;
+    }
+    auto i = static_cast<uint8_t>(s[cur]);
+    if (i == 0) {
+      break;
+    }
     if ((i & 0b1100'0000) == 0b1100'0000) {
+      if (cur + sizeof(uint16_t) > s.size()) {
+        return 0;
+      }
       uint16_t pointer{};
       memcpy(&pointer, s.data() + cur, sizeof(pointer));
       str::InplaceSwap(&pointer);
       pointer &= 0x3FFF;
+      // Only backward pointers are valid, which also rules out loops.
+      if (pointer >= cur) {
+        return 0;
+      }
       std::string pointer_name{};
-      ParseName(s, pointer, &pointer_name);
+      if (ParseName(s, pointer, &pointer_name) == 0) {
+        return 0;
+      }
       labels.push_back(std::move(pointer_name));
       cur += 2;
       *name = str::Join(".", labels);
       return cur - offset;
     } else {
       ++cur;
+      if (cur + i > s.size()) {
+        return 0;
+      }
       labels.emplace_back(s.substr(cur, i));
       cur += i;
     }
@@ -132,37 +404,24 @@ size_t ParseName(std::string_view s, size_t offset, std::string *name) {
   return cur - offset + 1;
 }
 
-std::string ParseIp(RecordType record_type, std::string_view data,
-                    size_t offset, size_t length) {
-  std::string ip{};
+std::string ParseRdata(RecordType record_type, std::string_view data,
+                       size_t offset, size_t length) {
+  std::string rdata{};
   switch (record_type) {
-    case RecordType::A: {
-      ip.resize(INET_ADDRSTRLEN);
-      inet_ntop(AF_INET, data.data() + offset, ip.data(), INET_ADDRSTRLEN);
-      ip.resize(ip.find_first_of('\000'));
-      break;
-    }
-    case RecordType::AAAA: {
-      ip.resize(INET6_ADDRSTRLEN);
-      inet_ntop(AF_INET6, data.data() + offset, ip.data(), INET6_ADDRSTRLEN);
-      ip.resize(ip.find_first_of('\000'));
-      break;
-    }
     case RecordType::CNAME:
     case RecordType::NS: {
-      ParseName(data, offset, &ip);
+      ParseName(data, offset, &rdata);
       break;
     }
     default: {
-      ip.assign(data.substr(offset, length));
+      rdata.assign(data.substr(offset, length));
       break;
     }
   }
-  return ip;
+  return rdata;
 }
 
 bool DnsResponse::Deserialize(std::string_view s) {
-  HeaderSection header{};
   bool ok{};
   size_t offset{header.Deserialize(s, &ok)};
   if (!ok) {
@@ -171,16 +430,63 @@ bool DnsResponse::Deserialize(std::string_view s) {
 
   for (uint16_t i = 0; i < header.questions; ++i) {
     QuestionSection question{};
-    offset += question.Deserialize(s, offset);
+    size_t n = question.Deserialize(s, offset);
+    if (n == 0) {
+      return false;
+    }
+    offset += n;
     questions.push_back(std::move(question));
   }
 
-  for (uint16_t i = 0; i < header.answer_rr; ++i) {
-    RecordSection record{};
-    offset += record.Deserialize(s, offset);
-    records.push_back(std::move(record));
+  auto parse_records = [&](uint16_t count, std::vector<RecordSection> *v) {
+    for (uint16_t i = 0; i < count; ++i) {
+      RecordSection record{};
+      size_t n = record.Deserialize(s, offset);
+      if (n == 0) {
+        return false;
+      }
+      offset += n;
+      v->push_back(std::move(record));
+    }
+    return true;
+  };
+  if (!parse_records(header.answer_rr, &records) ||
+      !parse_records(header.authority_rr, &authorities) ||
+      !parse_records(header.additional_rr, &additionals)) {
+    return false;
+  }
+
+  for (const auto &r : additionals) {
+    if (r.bin.type != RecordType::OPT) {
+      continue;
+    }
+    // RFC 6891 6.1.3: CLASS is the payload size, TTL is
+    // EXTENDED-RCODE(8) | VERSION(8) | DO(1) | Z(15).
+    auto ttl = static_cast<uint32_t>(r.bin.ttl);
+    edns.present = true;
+    edns.payload_size = static_cast<uint16_t>(r.bin.clazz);
+    edns.extended_rcode = static_cast<uint8_t>(ttl >> 24);
+    edns.version = static_cast<uint8_t>(ttl >> 16);
+    edns.dnssec_ok = ttl >> 15 & 1;
+    break;
   }
   return true;
 }
 
+uint32_t DnsResponse::NegativeTtl() const {
+  // RDATA is MNAME and RNAME, at least a byte each, then SERIAL, REFRESH,
+  // RETRY, EXPIRE and MINIMUM.
+  constexpr size_t kMinSoaSize = 2 + 5 * sizeof(uint32_t);
+  for (const auto &r : authorities) {
+    if (r.bin.type != RecordType::SOA || r.rdata.size() < kMinSoaSize) {
+      continue;
+    }
+    auto minimum = str::LoadBigEndian<uint32_t>(
+        reinterpret_cast<const uint8_t *>(r.rdata.data()) + r.rdata.size() -
+        sizeof(uint32_t));
+    return std::min(static_cast<uint32_t>(std::max(r.bin.ttl, 0)), minimum);
+  }
+  return 0;
+}
+
 }  // namespace boots
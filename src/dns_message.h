@@ -2,7 +2,12 @@
 
 #include <cstdint>
 #include <random>
+#include <string>
 #include <string_view>
+#include <vector>
+
+#include "boots/ip_address.h"
+#include "util.h"
 
 namespace boots {
 
@@ -11,44 +16,86 @@ enum class RecordType : uint16_t {
   AAAA = 28,
   CNAME = 5,
   NS = 2,
+  SOA = 6,
+  OPT = 41,
+};
+
+enum class ResponseCode : uint16_t {
+  kNoError = 0,
+  kFormErr = 1,
+  kServFail = 2,
+  kNxDomain = 3,
+  kNotImp = 4,
+  kRefused = 5,
+  kBadVers = 16,
 };
 
 enum class RecordClass : uint16_t {
   kIn = 1,
 };
 
-#pragma pack(push, 1)
 struct HeaderSection {
+  static constexpr size_t kSize = 12;
+
   uint16_t request_id{};
   struct Flags {
-    unsigned char qr : 1 {};
-    unsigned char op_code : 4 {};
-    unsigned char aa : 1 {};
-    unsigned char tc : 1 {};
-    unsigned char rd : 1 {};
-    unsigned char ra : 1 {};
-    unsigned char z : 1 {};
-    unsigned char ad : 1 {};
-    unsigned char cd : 1 {};
-    unsigned char rcode : 4 {};
+    bool qr{};
+    uint8_t op_code{};
+    bool aa{};
+    bool tc{};
+    bool rd{};
+    bool ra{};
+    bool z{};
+    bool ad{};
+    bool cd{};
+    uint8_t rcode{};
+
+    // Wire layout (RFC 1035 4.1.1), most significant bit first:
+    // QR | OPCODE(4) | AA | TC | RD | RA | Z | AD | CD | RCODE(4)
+    constexpr uint16_t Pack() const {
+      return static_cast<uint16_t>(
+          qr << 15 | (op_code & 0xF) << 11 | aa << 10 | tc << 9 | rd << 8 |
+          ra << 7 | z << 6 | ad << 5 | cd << 4 | (rcode & 0xF));
+    }
+    static constexpr Flags Unpack(uint16_t v) {
+      Flags f{};
+      f.qr = v >> 15 & 1;
+      f.op_code = v >> 11 & 0xF;
+      f.aa = v >> 10 & 1;
+      f.tc = v >> 9 & 1;
+      f.rd = v >> 8 & 1;
+      f.ra = v >> 7 & 1;
+      f.z = v >> 6 & 1;
+      f.ad = v >> 5 & 1;
+      f.cd = v >> 4 & 1;
+      f.rcode = v & 0xF;
+      return f;
+    }
   } flags{};
   uint16_t questions{};
   uint16_t answer_rr{};
   uint16_t authority_rr{};
   uint16_t additional_rr{};
-  explicit HeaderSection(bool rand_request_id = false)
+  constexpr HeaderSection() = default;
+  explicit HeaderSection(bool rand_request_id)
       : request_id{rand_request_id ? static_cast<decltype(request_id)>(rand())
                                    : uint16_t{}} {}
 
   static HeaderSection BuildRequest();
   size_t Deserialize(std::string_view s, bool *ok);
 
-  void Serialize(std::vector<uint8_t> *s);
-
- private:
-  void SwapSelf();
+  constexpr void Pack(uint8_t *out) const {
+    str::StoreBigEndian(request_id, out);
+    str::StoreBigEndian(flags.Pack(), out + 2);
+    str::StoreBigEndian(questions, out + 4);
+    str::StoreBigEndian(answer_rr, out + 6);
+    str::StoreBigEndian(authority_rr, out + 8);
+    str::StoreBigEndian(additional_rr, out + 10);
+  }
+  void Serialize(std::vector<uint8_t> *s) const;
 };
 
+#pragma pack(push, 1)
 struct QuestionSection {
   std::string qname{};
   struct {
@@ -59,12 +106,15 @@ struct QuestionSection {
   static QuestionSection BuildRequest(const std::string &hostname);
   size_t Deserialize(std::string_view data, size_t offset);
 
-  void Serialize(std::vector<uint8_t> *v);
+  void Serialize(std::vector<uint8_t> *v) const;
 };
 
 struct RecordSection {
   std::string name{};
-  std::string ip{};
+  // Set for A and AAAA records.
+  IpAddress ip{};
+  // The target name of CNAME and NS records; the raw bytes of other types.
+  std::string rdata{};
   struct {
     RecordType type{};
     RecordClass clazz{};
@@ -77,12 +127,70 @@ struct RecordSection {
 #pragma pack(pop)
 
 struct DnsResponse {
+  HeaderSection header{};
   std::vector<QuestionSection> questions{};
   std::vector<RecordSection> records{};
+  std::vector<RecordSection> authorities{};
+  std::vector<RecordSection> additionals{};
+  // Taken from the OPT pseudo-RR in the additional section, if any.
+  struct {
+    bool present{};
+    uint16_t payload_size{};
+    uint8_t extended_rcode{};
+    uint8_t version{};
+    bool dnssec_ok{};
+  } edns{};
 
   bool Deserialize(std::string_view s);
+
+  // The 12-bit RCODE, including the upper bits carried in OPT.
+  [[nodiscard]] ResponseCode Rcode() const {
+    return static_cast<ResponseCode>(edns.extended_rcode << 4 |
+                                     header.flags.rcode);
+  }
+  // How long an NXDOMAIN or NODATA answer may be cached (RFC 2308 5): the
+  // lesser of the authority SOA's TTL and its MINIMUM; zero without an SOA.
+  [[nodiscard]] uint32_t NegativeTtl() const;
 };
 
-std::vector<uint8_t> SerializeDnsRequest(const std::string &hostname);
+// Longest encoded name allowed on the wire (RFC 1035 2.3.4).
+constexpr size_t kMaxNameSize = 255;
+constexpr size_t kMaxLabelSize = 63;
+
+// Encodes `name` into DNS label format at `out`, which must have room for
+// kMaxNameSize bytes. Returns the encoded length, or 0 if the name is invalid.
+size_t EncodeName(std::string_view name, uint8_t *out);
+bool IsValidHostname(std::string_view name);
+
+// Returns an empty vector if `hostname` cannot be encoded. A non-zero
+// `edns_payload_size` appends an EDNS(0) OPT record advertising that size.
+std::vector<uint8_t> SerializeDnsRequest(const std::string &hostname,
+                                         uint16_t edns_payload_size = 0);
+
+// Answer records point back at the question name, so the TTL of the only
+// answer sits this many bytes past the end of the question.
+constexpr size_t kAnswerTtlOffset =
+    2 + sizeof(RecordType) + sizeof(RecordClass);
+
+// Whether an OPT record starts at `offset`, which for queries is right
+// after the question: clients send no other additional records.
+bool HasOptRecord(std::string_view message, size_t offset);
+// Appends an EDNS(0) OPT record advertising `payload_size` to a serialized
+// message, counting it in ARCOUNT.
+void AppendOptRecord(uint16_t payload_size, std::vector<uint8_t> *message);
+// Removes the OPT record from a serialized response, so that one of our own
+// can take its place, and lists where the TTLs of the records left are.
+// False if the message does not parse or carries more than one OPT.
+bool StripOptRecord(std::vector<uint8_t> *message,
+                    std::vector<size_t> *ttl_offsets);
+
+// Answers the query with `request_id` whose question section is `question`,
+// copied as is from the query. A non-empty `ip` becomes the only answer, as
+// an A or AAAA record by its family.
+std::vector<uint8_t> SerializeDnsResponse(uint16_t request_id, bool rd,
+                                          std::string_view question,
+                                          ResponseCode rcode,
+                                          const IpAddress &ip = {},
+                                          uint32_t ttl = 0);
 
 }  // namespace boots
@@ -2,30 +2,44 @@
 
 #include <fmt/format.h>
 #include <sys/ioctl.h>
+#include <unistd.h>
 
+#include <array>
+#include <charconv>
+#include <iterator>
 #include <regex>
+#include <utility>
 
 #include "boots/event_loop.h"
 #include "dns_message.h"
+#include "dns_tcp_transport.h"
+#include "frequency_sketch.h"
 #include "log.h"
 #include "net.h"
 #include "util.h"
 
 namespace boots {
+static std::string NegativeError(const std::string &hostname,
+                                 ResponseCode rcode) {
+  return rcode == ResponseCode::kNxDomain
+             ? fmt::format("unknown hostname {}", hostname)
+             : fmt::format("no address for {}", hostname);
+}
+
 DnsResolver::DnsResolver(EventLoop *loop,
-                         const std::vector<std::string> &servers)
-    : loop_{loop} {
+                         const std::vector<std::string> &servers,
+                         const DnsResolverOptions &options)
+    : loop_{loop},
+      options_{options},
+      sketch_{std::make_unique<FrequencySketch>(
+          options.frequency_sketch_width)} {
   for (const auto &s : servers) {
-    sockaddr_in sa{};
-    if (net::ToIpv4(s, reinterpret_cast<sockaddr_storage *>(&sa))) {
-      sa.sin_family = AF_INET;
-      sa.sin_port = 53;
-      str::InplaceSwap(&sa.sin_port);
-      servers_.emplace_back(sa);
-    }
+    AddServer(s);
   }
 }
 
+DnsResolver::~DnsResolver() = default;
+
 void DnsResolver::Init() {
   if (servers_.empty()) {
     ParseResolv();
@@ -36,34 +50,272 @@ void DnsResolver::Init() {
   }
 }
 
+struct DnsResolver::Bulk {
+  std::vector<Result> results;
+  size_t remaining{};
+  BulkCallbackFunc callback;
+
+  void Done(size_t idx, const IpAddress &ip, const std::string &error) {
+    results[idx].ip = ip;
+    results[idx].error = error;
+    Release();
+  }
+  void Release() {
+    if (--remaining == 0) {
+      callback(results);
+    }
+  }
+};
+
 void DnsResolver::Resolve(const std::string &hostname, CallbackFunc callback) {
-  if (hostname.empty()) {
-    callback(hostname, {}, "empty hostname");
+  IpAddress ip{};
+  std::string error{};
+  std::string canonical{};
+  if (ResolveLocal(hostname, &ip, &error, &canonical)) {
+    callback(hostname, ip, error);
     return;
   }
+  ResolveRemote(hostname, canonical, std::move(callback));
+}
 
-  if (net::ToIp(hostname)) {
-    callback(hostname, hostname, {});
+void DnsResolver::Lookup(const std::string &hostname,
+                         LookupCallbackFunc callback) {
+  IpAddress ip{};
+  std::string error{};
+  std::string canonical{};
+  std::chrono::seconds ttl{};
+  if (ResolveLocal(hostname, &ip, &error, &canonical, &ttl)) {
+    if (error.empty()) {
+      callback(ip, ResponseCode::kNoError, ttl, error);
+      return;
+    }
+    auto rcode = CachedNegative(hostname, &ttl);
+    callback(ip, rcode, ttl, error);
     return;
   }
+  ResolveRemote(hostname, canonical,
+                [this, callback = std::move(callback)](
+                    const std::string &name, const IpAddress &ip,
+                    const std::string &error) {
+                  if (error.empty()) {
+                    callback(ip, ResponseCode::kNoError, CachedTtl(name, ip),
+                             error);
+                    return;
+                  }
+                  std::chrono::seconds ttl{};
+                  auto rcode = CachedNegative(name, &ttl);
+                  callback(ip, rcode, ttl, error);
+                });
+}
+
+bool DnsResolver::FindLocal(const std::string &hostname, IpAddress *ip) const {
+  if (IpAddress::Parse(hostname, ip)) {
+    return true;
+  }
+  auto it = hosts_.find(hostname);
+  if (it == hosts_.end()) {
+    return false;
+  }
+  *ip = it->second;
+  return true;
+}
+
+std::vector<sockaddr_in> DnsResolver::Servers() const {
+  std::vector<sockaddr_in> servers{};
+  servers.reserve(servers_.size());
+  for (const auto &server : servers_) {
+    servers.push_back(server.addr);
+  }
+  return servers;
+}
+
+void DnsResolver::Touch(const std::string &hostname) {
+  IpAddress ip{};
+  std::string error{};
+  std::string canonical{};
+  ResolveLocal(hostname, &ip, &error, &canonical);
+}
+
+void DnsResolver::ResolveRemote(const std::string &hostname,
+                                const std::string &canonical,
+                                CallbackFunc callback) {
+  bool fresh = !hostname_callbacks_.contains(canonical);
+  if (fresh && !IsValidHostname(canonical)) {
+    callback(hostname, {}, fmt::format("invalid hostname {}", hostname));
+    return;
+  }
+  if (canonical != hostname) {
+    callback = ReportAs(hostname, std::move(callback));
+  }
+  AddCallback(canonical, std::move(callback));
+  if (fresh) {
+    Query(canonical);
+  }
+}
+
+void DnsResolver::ResolveMany(std::span<const std::string> hostnames,
+                              BulkCallbackFunc callback) {
+  auto bulk = std::make_shared<Bulk>();
+  bulk->callback = std::move(callback);
+  bulk->results.reserve(hostnames.size());
+  // Holds the result count while queuing so that answers delivered
+  // synchronously cannot complete the bulk early.
+  bulk->remaining = 1;
+
+  std::unordered_map<std::string_view, size_t> seen{};
+  seen.reserve(hostnames.size());
+  for (const auto &hostname : hostnames) {
+    if (!seen.insert({hostname, bulk->results.size()}).second) {
+      continue;
+    }
+    size_t idx = bulk->results.size();
+    bulk->results.push_back({hostname, {}, {}});
+    IpAddress ip{};
+    std::string error{};
+    std::string canonical{};
+    if (ResolveLocal(hostname, &ip, &error, &canonical)) {
+      bulk->results[idx].ip = ip;
+      bulk->results[idx].error = std::move(error);
+      continue;
+    }
+    // Failed here rather than from SendBulk(), whose loop the callback would
+    // re-enter once per invalid name.
+    if (!IsValidHostname(canonical)) {
+      bulk->results[idx].error = fmt::format("invalid hostname {}", hostname);
+      continue;
+    }
+
+    ++bulk->remaining;
+    bulk_queue_.emplace_back(
+        std::move(canonical),
+        [this, bulk, idx](const std::string &, const IpAddress &ip,
+                          const std::string &error) {
+          --bulk_inflight_;
+          bulk->Done(idx, ip, error);
+          SendBulk();
+        });
+  }
+  spdlog::info("[DnsResolver.ResolveMany] bulk resolving, total={}, queued={}",
+               bulk->results.size(), bulk->remaining - 1);
+  SendBulk();
+  bulk->Release();
+}
+
+bool DnsResolver::ResolveLocal(const std::string &hostname, IpAddress *ip,
+                               std::string *error, std::string *canonical,
+                               std::chrono::seconds *ttl) {
+  if (hostname.empty()) {
+    error->assign("empty hostname");
+    return true;
+  }
+
+  if (IpAddress::Parse(hostname, ip)) {
+    if (ttl != nullptr) {
+      *ttl = kNoExpiry;
+    }
+    return true;
+  }
 
   auto it = hosts_.find(hostname);
   if (it != hosts_.end()) {
     spdlog::info("[DnsResolver.Resolve] hostname hits hosts, hostname={}",
                  hostname);
-    callback(hostname, it->second, {});
-    return;
+    *ip = it->second;
+    if (ttl != nullptr) {
+      *ttl = kNoExpiry;
+    }
+    return true;
   }
 
-  std::string ip{};
-  if (cache_.Get(hostname, &ip)) {
+  sketch_->Add(hostname);
+  auto expire = AliasCache::TimePoint::max();
+  if (!FollowAliases(hostname, canonical, &expire)) {
+    error->assign(fmt::format("cname chain too long for {}", hostname));
+    return true;
+  }
+  if (*canonical != hostname) {
+    // Aliases share the target's entry, so they all count towards its heat.
+    sketch_->Add(*canonical);
+  }
+  if (const auto *entry = cache_.Find(*canonical)) {
+    *ip = entry->value;
     spdlog::info(
-        "[DnsResolver.Resolve] hostname hits cache, hostname={}, ip={}",
-        hostname, ip);
-    callback(hostname, ip, {});
-    return;
+        "[DnsResolver.Resolve] hostname hits cache, hostname={}, "
+        "canonical={}",
+        hostname, *canonical);
+    if (ttl != nullptr) {
+      *ttl = std::chrono::ceil<std::chrono::seconds>(
+          std::min(entry->expire, expire) - AddressCache::Clock::now());
+    }
+    MaybeRefresh(*canonical, *entry);
+    return true;
   }
+  if (const auto *entry = negative_cache_.Find(*canonical)) {
+    error->assign(NegativeError(hostname, entry->value));
+    return true;
+  }
+  return false;
+}
 
+std::chrono::seconds DnsResolver::CachedTtl(const std::string &hostname,
+                                            const IpAddress &ip) {
+  std::string canonical{};
+  auto expire = AliasCache::TimePoint::max();
+  if (!FollowAliases(hostname, &canonical, &expire)) {
+    return {};
+  }
+  const auto *entry = cache_.Find(canonical);
+  if (entry == nullptr || entry->value != ip) {
+    return {};
+  }
+  return std::chrono::ceil<std::chrono::seconds>(
+      std::min(entry->expire, expire) - AddressCache::Clock::now());
+}
+
+ResponseCode DnsResolver::CachedNegative(const std::string &hostname,
+                                         std::chrono::seconds *ttl) {
+  std::string canonical{};
+  auto expire = AliasCache::TimePoint::max();
+  const NegativeCache::Pair *entry{};
+  if (!FollowAliases(hostname, &canonical, &expire) ||
+      (entry = negative_cache_.Find(canonical)) == nullptr) {
+    *ttl = {};
+    return ResponseCode::kServFail;
+  }
+  *ttl = std::chrono::ceil<std::chrono::seconds>(
+      std::min(entry->expire, expire) - NegativeCache::Clock::now());
+  return entry->value;
+}
+
+bool DnsResolver::FollowAliases(const std::string &hostname,
+                                std::string *canonical,
+                                AliasCache::TimePoint *expire) {
+  canonical->assign(hostname);
+  for (size_t links = 0;; ++links) {
+    const auto *alias = cname_cache_.Find(*canonical);
+    if (alias == nullptr) {
+      return true;
+    }
+    // Also catches loops, which never terminate.
+    if (links == kMaxCnameChain) {
+      return false;
+    }
+    canonical->assign(alias->value);
+    if (expire != nullptr) {
+      *expire = std::min(*expire, alias->expire);
+    }
+  }
+}
+
+DnsResolver::CallbackFunc DnsResolver::ReportAs(const std::string &hostname,
+                                                CallbackFunc callback) {
+  return [hostname, callback = std::move(callback)](
+             const std::string &, const IpAddress &ip,
+             const std::string &error) { callback(hostname, ip, error); };
+}
+
+void DnsResolver::AddCallback(const std::string &hostname,
+                              CallbackFunc callback) {
   auto cb_it = hostname_callbacks_.find(hostname);
   if (cb_it == hostname_callbacks_.end()) {
     spdlog::info("[DnsResolver.Resolve] hostname resolving, hostname={}",
@@ -74,16 +326,395 @@ void DnsResolver::Resolve(const std::string &hostname, CallbackFunc callback) {
                  hostname);
     cb_it->second.emplace_back(std::move(callback));
   }
-  SendReq(hostname);
 }
 
-void DnsResolver::SendReq(const std::string &hostname) {
+struct DnsResolver::Batch {
+  // Deque, so that buffers keep their address as more are added.
+  std::deque<std::vector<uint8_t>> buffers{};
+  // The name each buffer asks for.
+  std::vector<std::string> names{};
+  // (server index, buffer index) per packet.
+  std::vector<std::pair<size_t, size_t>> packets{};
+};
+
+void DnsResolver::Query(const std::string &hostname) {
+  // Never overtakes misses that are already waiting.
+  if (waiting_.empty() && Admit(hostname)) {
+    return;
+  }
+  spdlog::info("[DnsResolver.Query] upstream busy, queued, hostname={}",
+               hostname);
+  waiting_.push_back({hostname, Clock::now()});
+  SchedulePump();
+}
+
+bool DnsResolver::Admit(const std::string &hostname) {
+  if (inflight_.size() >= options_.max_outstanding) {
+    return false;
+  }
+  Batch batch{};
+  size_t servers = Dispatch(hostname, &batch);
+  if (servers == 0) {
+    return false;
+  }
+  // Tracked first, so that a failure reported by Flush() finds the name.
+  Track(hostname, servers);
+  Flush(batch);
+  return true;
+}
+
+size_t DnsResolver::Dispatch(const std::string &hostname, Batch *batch) {
+  static constexpr size_t kNone = -1;
+  // Indexed by whether the query carries an OPT record.
+  std::array<size_t, 2> buffer{kNone, kNone};
+  auto now = Clock::now();
+  size_t sent = 0;
+  for (size_t i = 0; i < servers_.size(); ++i) {
+    auto &server = servers_[i];
+    if (!TakeToken(&server, now)) {
+      continue;
+    }
+    bool edns = !options_.force_tcp && UseEdns(server);
+    if (buffer[edns] == kNone) {
+      buffer[edns] = batch->buffers.size();
+      batch->buffers.push_back(SerializeDnsRequest(
+          hostname, edns ? options_.edns_payload_size : 0));
+      batch->names.push_back(hostname);
+    }
+    batch->packets.emplace_back(i, buffer[edns]);
+    ++sent;
+  }
+  return sent;
+}
+
+void DnsResolver::Flush(const Batch &batch) {
+  if (batch.packets.empty()) {
+    return;
+  }
+  if (options_.force_tcp && tcp_ != nullptr) {
+    for (const auto &[server, buffer] : batch.packets) {
+      SendTcp(batch.names[buffer], servers_[server].addr,
+              batch.buffers[buffer]);
+    }
+    return;
+  }
+
+  std::vector<iovec> iovs{};
+  iovs.reserve(batch.buffers.size());
+  for (const auto &plain : batch.buffers) {
+    iovs.push_back({const_cast<uint8_t *>(plain.data()), plain.size()});
+  }
+  std::vector<mmsghdr> msgs{};
+  msgs.reserve(batch.packets.size());
+  for (const auto &[server, buffer] : batch.packets) {
+    mmsghdr msg{};
+    msg.msg_hdr.msg_name = &servers_[server].addr;
+    msg.msg_hdr.msg_namelen = sizeof(servers_[server].addr);
+    msg.msg_hdr.msg_iov = &iovs[buffer];
+    msg.msg_hdr.msg_iovlen = 1;
+    msgs.push_back(msg);
+  }
+  for (size_t sent = 0; sent < msgs.size();) {
+    int n = sendmmsg(fd_, msgs.data() + sent, msgs.size() - sent, 0);
+    if (n <= 0) {
+      LOG_ERRNO_L(ERROR, "sent={}, total={}", sent, msgs.size());
+      break;
+    }
+    sent += n;
+  }
+}
+
+bool DnsResolver::TakeToken(Upstream *upstream, Clock::time_point now) {
+  if (options_.upstream_qps <= 0) {
+    return true;
+  }
+  std::chrono::duration<double> elapsed = now - upstream->refilled;
+  upstream->tokens =
+      std::min(options_.upstream_burst,
+               upstream->tokens + elapsed.count() * options_.upstream_qps);
+  upstream->refilled = now;
+  if (upstream->tokens < 1) {
+    return false;
+  }
+  upstream->tokens -= 1;
+  return true;
+}
+
+void DnsResolver::Track(const std::string &hostname, size_t servers) {
+  uint64_t seq = ++query_seq_;
+  inflight_[hostname] = {seq, servers};
+  if (loop_ == nullptr) {
+    return;
+  }
+  loop_->RunAfter(options_.query_timeout,
+                  [w = weak_from_this(), hostname, seq] {
+                    if (auto r = w.lock()) {
+                      r->Expire(hostname, seq);
+                    }
+                  });
+}
+
+void DnsResolver::Expire(const std::string &hostname, uint64_t seq) {
+  auto it = inflight_.find(hostname);
+  if (it == inflight_.end() || it->second.seq != seq) {
+    return;
+  }
+  inflight_.erase(it);
+  spdlog::warn("[DnsResolver.Expire] query timed out, hostname={}", hostname);
+  Fail(hostname, fmt::format("timeout resolving {}", hostname));
+  Pump();
+}
+
+void DnsResolver::Pump() {
+  auto now = Clock::now();
+  Batch batch{};
+  while (!waiting_.empty()) {
+    auto &front = waiting_.front();
+    // Answered through another path, or failed, while it waited.
+    if (!hostname_callbacks_.contains(front.hostname) ||
+        inflight_.contains(front.hostname)) {
+      waiting_.pop_front();
+      continue;
+    }
+    if (now - front.since > options_.max_queue_time) {
+      auto hostname = std::move(front.hostname);
+      waiting_.pop_front();
+      spdlog::warn("[DnsResolver.Pump] queue time exceeded, hostname={}",
+                   hostname);
+      Fail(hostname, fmt::format("upstream busy resolving {}", hostname));
+      continue;
+    }
+    if (inflight_.size() >= options_.max_outstanding) {
+      break;
+    }
+    size_t servers = Dispatch(front.hostname, &batch);
+    if (servers == 0) {
+      break;
+    }
+    Track(front.hostname, servers);
+    waiting_.pop_front();
+  }
+  Flush(batch);
+  SendBulk();
+  SchedulePump();
+}
+
+void DnsResolver::SchedulePump() {
+  bool bulk_blocked = !bulk_queue_.empty() &&
+                      bulk_inflight_ < options_.max_bulk_inflight;
+  if (pump_scheduled_ || loop_ == nullptr ||
+      (waiting_.empty() && !bulk_blocked)) {
+    return;
+  }
+  // Wakes for the next token or for the head of the queue running out of
+  // time, whichever is first; freed slots pump on their own.
+  Clock::duration delay = options_.max_queue_time;
+  if (!waiting_.empty()) {
+    delay = std::max<Clock::duration>(
+        waiting_.front().since + options_.max_queue_time - Clock::now(), {});
+  }
+  if (options_.upstream_qps > 0) {
+    delay = std::min<Clock::duration>(
+        delay, std::chrono::duration_cast<Clock::duration>(
+                   std::chrono::duration<double>(1 / options_.upstream_qps)));
+  }
+  pump_scheduled_ = true;
+  loop_->RunAfter(delay, [w = weak_from_this()] {
+    if (auto r = w.lock()) {
+      r->pump_scheduled_ = false;
+      r->Pump();
+    }
+  });
+}
+
+void DnsResolver::Fail(std::string hostname, const std::string &error) {
+  auto it = hostname_callbacks_.find(hostname);
+  if (it == hostname_callbacks_.end()) {
+    return;
+  }
+  auto callbacks = std::move(it->second);
+  hostname_callbacks_.erase(it);
+  tcp_queries_.erase(hostname);
+  for (const CallbackFunc &callback : callbacks) {
+    callback(hostname, {}, error);
+  }
+}
+
+void DnsResolver::SendBulk() {
+  // Bulk callbacks call back in here when answered from cache below; this
+  // loop picks up the slots they free instead.
+  if (sending_bulk_) {
+    return;
+  }
+  sending_bulk_ = true;
+  Batch batch{};
+  while (bulk_inflight_ < options_.max_bulk_inflight && !bulk_queue_.empty()) {
+    auto [hostname, callback] = std::move(bulk_queue_.front());
+    bulk_queue_.pop_front();
+    // Answers and aliases may have arrived since the name was queued.
+    std::string canonical{};
+    IpAddress ip{};
+    std::string error{};
+    if (!FollowAliases(hostname, &canonical)) {
+      error = fmt::format("cname chain too long for {}", hostname);
+    } else if (const auto *entry = cache_.Find(canonical)) {
+      ip = entry->value;
+    } else if (const auto *entry = negative_cache_.Find(canonical)) {
+      error = NegativeError(hostname, entry->value);
+    } else if (canonical != hostname && !IsValidHostname(canonical)) {
+      error = fmt::format("invalid hostname {}", hostname);
+    } else if (!inflight_.contains(canonical)) {
+      // Sends a name that is new or only waiting, so that bulk callers join
+      // a query in flight and never expire in the miss queue. Names were
+      // validated by ResolveMany().
+      size_t servers = inflight_.size() < options_.max_outstanding
+                           ? Dispatch(canonical, &batch)
+                           : 0;
+      if (servers == 0) {
+        bulk_queue_.emplace_front(std::move(hostname), std::move(callback));
+        break;
+      }
+      Track(canonical, servers);
+    }
+    ++bulk_inflight_;
+    if (!ip.Empty() || !error.empty()) {
+      callback(hostname, ip, error);
+      continue;
+    }
+    if (canonical != hostname) {
+      callback = ReportAs(hostname, std::move(callback));
+    }
+    AddCallback(canonical, std::move(callback));
+  }
+  sending_bulk_ = false;
+  Flush(batch);
+  if (!bulk_queue_.empty()) {
+    SchedulePump();
+  }
+}
+
+bool DnsResolver::UseEdns(const Upstream &upstream) const {
+  return options_.edns_payload_size != 0 &&
+         (upstream.edns ||
+          std::chrono::steady_clock::now() >= upstream.edns_probe_at);
+}
+
+bool DnsResolver::CheckEdns(const DnsResponse &resp,
+                            const sockaddr_in &server) {
+  static constexpr std::chrono::minutes kEdnsReprobeInterval{10};
+  auto it = std::find_if(servers_.begin(), servers_.end(), [&](const auto &u) {
+    return u.addr.sin_addr.s_addr == server.sin_addr.s_addr &&
+           u.addr.sin_port == server.sin_port;
+  });
+  if (it == servers_.end() || !UseEdns(*it) || resp.questions.empty()) {
+    return true;
+  }
+  if (resp.edns.present) {
+    it->edns = true;
+    return true;
+  }
+
+  // RFC 6891 7: a responder without EDNS support answers FORMERR or NOTIMP,
+  // or ignores the OPT record altogether.
+  it->edns = false;
+  it->edns_probe_at = std::chrono::steady_clock::now() + kEdnsReprobeInterval;
+  auto rcode = resp.Rcode();
+  if (rcode != ResponseCode::kFormErr && rcode != ResponseCode::kNotImp) {
+    return true;
+  }
+  const std::string &hostname = resp.questions[0].qname;
+  spdlog::warn("[DnsResolver.CheckEdns] server rejects EDNS, hostname={}",
+               hostname);
+  // The plain resend is admitted like any other miss, so it is paced and
+  // capped; the server now gets it without OPT.
+  if (hostname_callbacks_.contains(hostname)) {
+    inflight_.erase(hostname);
+    Query(hostname);
+  }
+  return false;
+}
+
+void DnsResolver::SendTcp(const std::string &hostname,
+                          const sockaddr_in &server,
+                          std::vector<uint8_t> query) {
+  ++tcp_queries_[hostname].pending;
+  tcp_->Send(server, std::move(query));
+}
+
+void DnsResolver::RetryOverTcp(const DnsResponse &truncated,
+                               const sockaddr_in &server) {
+  const std::string &hostname = truncated.questions[0].qname;
+  if (tcp_ == nullptr || !hostname_callbacks_.contains(hostname)) {
+    Handle(truncated);
+    return;
+  }
+  // Every server may truncate the same answer; one TCP query is enough,
+  // and stands in for all of them.
+  if (tcp_queries_.contains(hostname)) {
+    if (auto it = inflight_.find(hostname);
+        it != inflight_.end() && it->second.servers > 1) {
+      --it->second.servers;
+    }
+    return;
+  }
   auto plain = SerializeDnsRequest(hostname);
+  if (plain.empty()) {
+    Handle(truncated);
+    return;
+  }
+  spdlog::info("[DnsResolver.RetryOverTcp] answer truncated, hostname={}",
+               hostname);
+  tcp_queries_[hostname].truncated = std::make_shared<DnsResponse>(truncated);
+  SendTcp(hostname, server, std::move(plain));
+}
 
-  for (const auto &server : servers_) {
-    sendto(fd_, plain.data(), plain.size(), 0, (struct sockaddr *)&server,
-           sizeof(server));
+void DnsResolver::OnTcpFailure(std::string_view query) {
+  QuestionSection question{};
+  if (!question.Deserialize(query, HeaderSection::kSize)) {
+    return;
   }
+  auto it = tcp_queries_.find(question.qname);
+  if (it == tcp_queries_.end() || --it->second.pending > 0) {
+    return;
+  }
+  auto truncated = std::move(it->second.truncated);
+  tcp_queries_.erase(it);
+  // Whatever fit in the truncated answer beats no answer at all.
+  if (truncated != nullptr && !truncated->records.empty()) {
+    Handle(*truncated);
+    return;
+  }
+  inflight_.erase(question.qname);
+  Fail(question.qname,
+       fmt::format("tcp query failed for {}", question.qname));
+  Pump();
+}
+
+void DnsResolver::MaybeRefresh(const std::string &hostname,
+                               const AddressCache::Pair &entry) {
+  if (options_.refresh_ahead_ratio <= 0) {
+    return;
+  }
+  auto remaining = entry.expire - AddressCache::Clock::now();
+  if (remaining > entry.ttl * options_.refresh_ahead_ratio) {
+    return;
+  }
+  // Cold entries are left to expire so they do not generate upstream load.
+  if (sketch_->Estimate(hostname) < options_.refresh_ahead_min_hits) {
+    return;
+  }
+  // A query already in flight refreshes the entry when it is answered.
+  if (hostname_callbacks_.contains(hostname)) {
+    return;
+  }
+  // Refreshes are optional: they never queue behind, or ahead of, misses.
+  if (!waiting_.empty() || !Admit(hostname)) {
+    return;
+  }
+  spdlog::info("[DnsResolver.MaybeRefresh] refreshing ahead, hostname={}",
+               hostname);
+  // No waiters: Handle() just repopulates the cache.
+  hostname_callbacks_.insert({hostname, {}});
 }
 
 void DnsResolver::Callback(int fd, uint32_t events) {
@@ -105,7 +736,7 @@ void DnsResolver::Callback(int fd, uint32_t events) {
 
   std::unique_ptr<char[]> buf{new char[size]};
   struct sockaddr_in sa {};
-  socklen_t sa_len{};
+  socklen_t sa_len{sizeof(sa)};
   auto n = recvfrom(fd_, buf.get(), size, 0, (struct sockaddr *)&sa, &sa_len);
   if (n != size) {
     spdlog::error(
@@ -122,6 +753,13 @@ void DnsResolver::Callback(int fd, uint32_t events) {
     return;
   }
 
+  if (!CheckEdns(response, sa)) {
+    return;
+  }
+  if (response.header.flags.tc && !response.questions.empty()) {
+    RetryOverTcp(response, sa);
+    return;
+  }
   Handle(response);
 }
 
@@ -131,33 +769,214 @@ void DnsResolver::Handle(const DnsResponse &resp) {
   }
 
   const std::string &hostname = resp.questions[0].qname;
-  size_t idx = record_idx_++;
-  for (size_t i = 0; i < resp.records.size(); ++i) {
-    const auto &r = resp.records.at((i + idx) % resp.records.size());
-    if (r.bin.type == RecordType::A || r.bin.type == RecordType::AAAA) {
-      auto callbacks_it = hostname_callbacks_.find(hostname);
-      if (callbacks_it == hostname_callbacks_.end()) {
-        return;
-      }
+  auto callbacks_it = hostname_callbacks_.find(hostname);
+  if (callbacks_it == hostname_callbacks_.end()) {
+    return;
+  }
+  // Only NXDOMAIN and NODATA say the name has no address. Any other failure
+  // is one server's, so the others still get to answer.
+  auto rcode = resp.Rcode();
+  bool failed =
+      rcode != ResponseCode::kNoError && rcode != ResponseCode::kNxDomain;
+  if (auto it = inflight_.find(hostname);
+      failed && it != inflight_.end() && it->second.servers > 1) {
+    --it->second.servers;
+    spdlog::warn(
+        "[DnsResolver.Handle] server failed, waiting for others, "
+        "hostname={}, rcode={}",
+        hostname, static_cast<int>(rcode));
+    return;
+  }
+  auto callbacks = std::move(callbacks_it->second);
+  hostname_callbacks_.erase(callbacks_it);
+  tcp_queries_.erase(hostname);
+  inflight_.erase(hostname);
 
-      auto callbacks = std::move(callbacks_it->second);
-      hostname_callbacks_.erase(callbacks_it);
-      std::string error_msg{};
-      if (r.ip.empty()) {
-        error_msg.assign(fmt::format("unknown hostname {}", hostname));
-      } else {
-        cache_.Put(hostname, r.ip);
+  // Follows the CNAME chain inside the answer, caching each link under its
+  // own TTL so that other aliases of the same target resolve from cache.
+  // Owner names may come back in any letter case (RFC 4343).
+  std::string name{hostname};
+  std::vector<std::string_view> chain{hostname};
+  std::vector<const RecordSection *> addresses{};
+  std::string error_msg{};
+  for (;;) {
+    const RecordSection *alias{};
+    for (const auto &r : resp.records) {
+      if (!str::EqualsIgnoreCase(r.name, name)) {
+        continue;
       }
-      for (const CallbackFunc &callback : callbacks) {
-        callback(hostname, r.ip, error_msg);
+      if (!r.ip.Empty()) {
+        addresses.push_back(&r);
+      } else if (r.bin.type == RecordType::CNAME && !r.rdata.empty()) {
+        alias = &r;
       }
+    }
+    if (!addresses.empty() || alias == nullptr) {
+      break;
+    }
+    auto seen = [alias](std::string_view link) {
+      return str::EqualsIgnoreCase(link, alias->rdata);
+    };
+    if (std::any_of(chain.begin(), chain.end(), seen)) {
+      error_msg.assign(fmt::format("cname loop for {}", hostname));
+      break;
+    }
+    if (chain.size() > kMaxCnameChain) {
+      error_msg.assign(fmt::format("cname chain too long for {}", hostname));
       break;
     }
+    cname_cache_.Put(name, alias->rdata,
+                     std::chrono::seconds{std::max(alias->bin.ttl, 1)});
+    name = alias->rdata;
+    chain.push_back(alias->rdata);
   }
+
+  // The answer stops at an alias: continue from its target, unless cached
+  // links from earlier answers already make the chain too long.
+  std::string canonical{};
+  if (error_msg.empty() && addresses.empty() && name != hostname &&
+      rcode != ResponseCode::kNxDomain) {
+    if (!FollowAliases(hostname, &canonical)) {
+      error_msg.assign(fmt::format("cname chain too long for {}", hostname));
+    } else if (hostname_callbacks_.contains(canonical) ||
+               IsValidHostname(canonical)) {
+      // A refresh has no callbacks but still needs the entry to be tracked.
+      auto [it, fresh] = hostname_callbacks_.try_emplace(canonical);
+      for (auto &callback : callbacks) {
+        it->second.push_back(ReportAs(hostname, std::move(callback)));
+      }
+      if (fresh) {
+        Query(canonical);
+      }
+      Pump();
+      return;
+    }
+  }
+
+  IpAddress ip{};
+  if (!addresses.empty()) {
+    const auto *r = addresses[record_idx_++ % addresses.size()];
+    ip = r->ip;
+    if (r->bin.ttl > 0) {
+      cache_.Put(name, ip, std::chrono::seconds{r->bin.ttl});
+    }
+  }
+  if (ip.Empty() && error_msg.empty() && failed) {
+    error_msg.assign(fmt::format("server failure resolving {}", hostname));
+  } else if (ip.Empty() && error_msg.empty()) {
+    // NXDOMAIN or NODATA, cached for as long as the zone allows. Without an
+    // SOA it is still kept briefly, so a burst of misses asks only once.
+    auto negative = rcode == ResponseCode::kNxDomain ? rcode
+                                                     : ResponseCode::kNoError;
+    negative_cache_.Put(
+        name, negative,
+        std::chrono::seconds{std::max<uint32_t>(resp.NegativeTtl(), 1)});
+    error_msg.assign(NegativeError(hostname, negative));
+  }
+  // The freed slot goes to the longest-waiting miss. Pumped only now that
+  // the answer is cached, so queued bulk names find it there rather than
+  // query it again.
+  Pump();
+  for (const CallbackFunc &callback : callbacks) {
+    callback(hostname, ip, error_msg);
+  }
+}
+
+void DnsResolver::Detach() {
+  // Not added to a loop yet, or already detached.
+  if (tcp_ == nullptr || fd_ < 0) {
+    return;
+  }
+  loop_->Remove(fd_);
+  close(fd_);
+  fd_ = -1;
+  if (std::exchange(options_.force_tcp, true)) {
+    return;
+  }
+  // Answers to these now reach the successor; ask again on our own
+  // connections. The query timeouts already armed still apply.
+  Batch batch{};
+  for (auto &[hostname, query] : inflight_) {
+    if (!tcp_queries_.contains(hostname)) {
+      query.servers = Dispatch(hostname, &batch);
+    }
+  }
+  Flush(batch);
+}
+
+std::string DnsResolver::ExportCache() const {
+  // One "<kind> <remaining ms> <name> <value>" line per entry; kind A maps a
+  // canonical name to an address, C an alias to its target.
+  std::string data{};
+  auto now = AddressCache::Clock::now();
+  auto dump = [&data, now](char kind, const auto &cache, auto text) {
+    cache.ForEach([&](const auto &pair) {
+      auto left = std::chrono::duration_cast<std::chrono::milliseconds>(
+          pair.expire - now);
+      if (left.count() > 0) {
+        fmt::format_to(std::back_inserter(data), "{} {} {} {}\n", kind,
+                       left.count(), pair.key, text(pair.value));
+      }
+    });
+  };
+  dump('A', cache_, [](const IpAddress &ip) { return ip.ToString(); });
+  dump('C', cname_cache_, [](const std::string &name) { return name; });
+  return data;
+}
+
+void DnsResolver::ImportCache(std::string_view data) {
+  size_t imported = 0;
+  while (!data.empty()) {
+    auto eol = data.find('\n');
+    auto line = data.substr(0, eol);
+    data.remove_prefix(eol == std::string_view::npos ? data.size() : eol + 1);
+
+    std::string_view fields[4]{};
+    size_t n = 0;
+    for (; n < 4 && !line.empty(); ++n) {
+      auto sp = n < 3 ? line.find(' ') : std::string_view::npos;
+      fields[n] = line.substr(0, sp);
+      line.remove_prefix(sp == std::string_view::npos ? line.size() : sp + 1);
+    }
+    int64_t ms{};
+    auto [ptr, ec] = std::from_chars(
+        fields[1].data(), fields[1].data() + fields[1].size(), ms);
+    if (n != 4 || fields[0].size() != 1 || ec != std::errc{} || ms <= 0) {
+      continue;
+    }
+    if (fields[0][0] == 'C') {
+      cname_cache_.Put(std::string{fields[2]}, std::string{fields[3]},
+                       std::chrono::milliseconds{ms});
+    } else {
+      IpAddress ip{};
+      if (!IpAddress::Parse(fields[3], &ip)) {
+        continue;
+      }
+      cache_.Put(std::string{fields[2]}, ip, std::chrono::milliseconds{ms});
+    }
+    ++imported;
+  }
+  spdlog::info("[DnsResolver.ImportCache] imported, entries={}", imported);
 }
 
 void DnsResolver::AddToLoop() {
-  fd_ = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  fd_ = options_.socket_fd >= 0
+            ? options_.socket_fd
+            : socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  tcp_ = std::make_unique<DnsTcpTransport>(
+      loop_,
+      [this](std::string_view message) {
+        DnsResponse response{};
+        if (response.Deserialize(message)) {
+          Handle(response);
+        }
+      },
+      [w = weak_from_this()](std::string_view query) {
+        if (auto r = w.lock()) {
+          r->OnTcpFailure(query);
+        }
+      },
+      options_.tcp_connections_per_server);
   loop_->Add(fd_, EventLoop::kPollIn,
              [r = shared_from_this()](int fd, uint32_t events) {
                r->Callback(fd, events);
@@ -173,32 +992,37 @@ void DnsResolver::ParseResolv() {
       continue;
     }
 
-    std::string server = match[1].str();
-    sockaddr_in sa{};
-    if (net::ToIpv4(server, reinterpret_cast<sockaddr_storage *>(&sa))) {
-      sa.sin_family = AF_INET;
-      sa.sin_port = 53;
-      str::InplaceSwap(&sa.sin_port);
-      servers_.emplace_back(sa);
-    }
+    AddServer(match[1].str());
   }
 
   if (servers_.empty()) {
     constexpr std::array<std::string_view, 2> kGoogleDnsServers{"8.8.8.8",
-                                                                "4.4.4.4"};
+                                                                "8.8.4.4"};
     for (const auto &s : kGoogleDnsServers) {
-      sockaddr_in sa{};
-      net::ToIpv4(s, reinterpret_cast<sockaddr_storage *>(&sa));
-      servers_.emplace_back(sa);
+      AddServer(std::string{s});
     }
   }
 }
 
+void DnsResolver::AddServer(const std::string &server) {
+  sockaddr_in sa{};
+  if (net::ToIpv4(server, reinterpret_cast<sockaddr_storage *>(&sa))) {
+    sa.sin_family = AF_INET;
+    sa.sin_port = 53;
+    str::InplaceSwap(&sa.sin_port);
+    Upstream upstream{sa};
+    upstream.tokens = options_.upstream_burst;
+    upstream.refilled = Clock::now();
+    servers_.push_back(upstream);
+  }
+}
+
 void DnsResolver::ParseHosts() {
   file::Lines lines{"/etc/hosts"};
   auto it = lines.begin();
   if (it == lines.end()) {
-    hosts_.insert({"localhost", "127.0.0.1"});
+    constexpr uint8_t kLoopback[] = {127, 0, 0, 1};
+    hosts_.insert({"localhost", IpAddress::FromV4(kLoopback)});
     return;
   }
 
@@ -208,8 +1032,8 @@ void DnsResolver::ParseHosts() {
     if (parts.size() < 2) {
       continue;
     }
-    std::string ip{parts[0]};
-    if (!net::ToIp(ip)) {
+    IpAddress ip{};
+    if (!IpAddress::Parse(parts[0], &ip)) {
       continue;
     }
 
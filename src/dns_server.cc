@@ -0,0 +1,674 @@
+#include "boots/dns_server.h"
+
+#include <netinet/tcp.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+
+#include "boots/dns_resolver.h"
+#include "boots/event_loop.h"
+#include "dns_message.h"
+#include "log.h"
+#include "net.h"
+#include "util.h"
+
+namespace boots {
+
+// Receive slots take queries up to the UDP payload size we advertise in
+// OPT; anything larger is truncated and dropped.
+static constexpr size_t kMaxUdpQuery = kDefaultEdnsPayloadSize;
+// Answers held while the socket buffer is full; more are dropped and left
+// to the clients' retries.
+static constexpr size_t kMaxPendingDatagrams = 4096;
+static constexpr size_t kReadChunk = 16 * 1024;
+// Largest UDP answer to a client without EDNS (RFC 1035 4.2.1).
+static constexpr size_t kMaxPlainUdpAnswer = 512;
+// Relayed questions in flight; more get SERVFAIL.
+static constexpr size_t kMaxRelays = 4096;
+static constexpr size_t kMaxRelayAnswer = 64 * 1024;
+// TC and RD are the low bits of the first flags byte.
+static constexpr size_t kFlagsOffset = 2;
+static constexpr uint8_t kTcBit = 0x02;
+static constexpr uint8_t kRdBit = 0x01;
+
+struct DnsServer::Connection {
+  int fd{-1};
+  bool dispatching{};
+  // Last query read or answer queued; idle connections are closed.
+  EventLoop::Clock::time_point active{};
+  std::string rbuf{};
+  std::string wbuf{};
+};
+
+static std::string ToLower(std::string_view s) {
+  std::string lower{s};
+  for (char &c : lower) {
+    if (c >= 'A' && c <= 'Z') {
+      c = static_cast<char>(c - 'A' + 'a');
+    }
+  }
+  return lower;
+}
+
+DnsServer::DnsServer(EventLoop *loop, std::shared_ptr<DnsResolver> resolver,
+                     const DnsServerOptions &options)
+    : loop_{loop}, resolver_{std::move(resolver)}, options_{options} {
+  options_.batch_size = std::max<size_t>(options_.batch_size, 1);
+}
+
+DnsServer::~DnsServer() {
+  while (!conns_.empty()) {
+    CloseTcp(conns_.begin()->second.get());
+  }
+  for (int fd : {udp_fd_, tcp_fd_, relay_fd_}) {
+    if (fd >= 0) {
+      close(fd);
+    }
+  }
+}
+
+bool DnsServer::Init() {
+  udp_fd_ = Bind(SOCK_DGRAM);
+  tcp_fd_ = Bind(SOCK_STREAM);
+  if (udp_fd_ < 0 || tcp_fd_ < 0) {
+    return false;
+  }
+  relay_fd_ = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (relay_fd_ < 0) {
+    LOG_ERRNO();
+    return false;
+  }
+  upstreams_ = resolver_->Servers();
+  relay_buf_.resize(kMaxRelayAnswer);
+
+  size_t batch = options_.batch_size;
+  rbuf_.resize(batch * kMaxUdpQuery);
+  raddrs_.resize(batch);
+  riovs_.resize(batch);
+  rmsgs_.resize(batch);
+  for (size_t i = 0; i < batch; ++i) {
+    riovs_[i] = {rbuf_.data() + i * kMaxUdpQuery, kMaxUdpQuery};
+    rmsgs_[i].msg_hdr.msg_name = &raddrs_[i];
+    rmsgs_[i].msg_hdr.msg_iov = &riovs_[i];
+    rmsgs_[i].msg_hdr.msg_iovlen = 1;
+  }
+  siovs_.resize(batch);
+  smsgs_.resize(batch);
+
+  loop_->Add(udp_fd_, EventLoop::kPollIn,
+             [s = shared_from_this()](int, uint32_t events) {
+               s->OnUdp(events);
+             });
+  loop_->Add(tcp_fd_, EventLoop::kPollIn,
+             [s = shared_from_this()](int, uint32_t) { s->Accept(); });
+  loop_->Add(relay_fd_, EventLoop::kPollIn,
+             [s = shared_from_this()](int, uint32_t) { s->OnRelay(); });
+  spdlog::info("[DnsServer.Init] serving, address={}, port={}",
+               options_.address, options_.port);
+  return true;
+}
+
+int DnsServer::Bind(int type) {
+  sockaddr_storage sa{};
+  if (!net::ToSockaddr(options_.address, options_.port, &sa)) {
+    SPDLOG_ERROR("[DnsServer] bad address, address={}", options_.address);
+    return -1;
+  }
+  int fd = socket(sa.ss_family, type | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (fd < 0) {
+    LOG_ERRNO();
+    return -1;
+  }
+  int val{1};
+  setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &val, sizeof(val));
+  if (bind(fd, reinterpret_cast<const sockaddr *>(&sa),
+           net::SockaddrLen(sa)) != 0 ||
+      (type == SOCK_STREAM && listen(fd, SOMAXCONN) != 0)) {
+    LOG_ERRNO();
+    close(fd);
+    return -1;
+  }
+  loop_->TuneSocket(fd);
+  return fd;
+}
+
+void DnsServer::OnUdp(uint32_t events) {
+  if (events & EventLoop::kPollOut) {
+    FlushUdp();
+  }
+  if (events & EventLoop::kPollIn) {
+    Receive();
+  }
+}
+
+void DnsServer::Receive() {
+  for (auto &msg : rmsgs_) {
+    msg.msg_hdr.msg_namelen = sizeof(sockaddr_storage);
+  }
+  int n = recvmmsg(udp_fd_, rmsgs_.data(), rmsgs_.size(), 0, nullptr);
+  if (n < 0) {
+    if (errno != EAGAIN && errno != EWOULDBLOCK) {
+      LOG_ERRNO();
+    }
+    return;
+  }
+
+  dispatching_ = true;
+  Client client{};
+  for (int i = 0; i < n; ++i) {
+    if (rmsgs_[i].msg_hdr.msg_flags & MSG_TRUNC) {
+      continue;
+    }
+    client.addr = raddrs_[i];
+    Handle({rbuf_.data() + i * kMaxUdpQuery, rmsgs_[i].msg_len}, client);
+  }
+  dispatching_ = false;
+  FlushUdp();
+}
+
+void DnsServer::FlushUdp() {
+  size_t sent = 0;
+  while (sent < udp_out_.size()) {
+    size_t count = std::min(smsgs_.size(), udp_out_.size() - sent);
+    for (size_t i = 0; i < count; ++i) {
+      auto &datagram = udp_out_[sent + i];
+      siovs_[i] = {datagram.data.data(), datagram.data.size()};
+      smsgs_[i] = {};
+      smsgs_[i].msg_hdr.msg_name = &datagram.addr;
+      smsgs_[i].msg_hdr.msg_namelen = net::SockaddrLen(datagram.addr);
+      smsgs_[i].msg_hdr.msg_iov = &siovs_[i];
+      smsgs_[i].msg_hdr.msg_iovlen = 1;
+    }
+    int n = sendmmsg(udp_fd_, smsgs_.data(), count, 0);
+    if (n < 0) {
+      if (errno == EAGAIN || errno == EWOULDBLOCK) {
+        break;
+      }
+      // Skips the datagram that failed, e.g. to an unreachable client.
+      LOG_ERRNO();
+      n = 1;
+    }
+    sent += n;
+  }
+  udp_out_.erase(udp_out_.begin(), udp_out_.begin() + sent);
+
+  bool blocked = !udp_out_.empty();
+  if (blocked != udp_blocked_) {
+    udp_blocked_ = blocked;
+    loop_->Modify(udp_fd_, EventLoop::kPollIn |
+                               (blocked ? EventLoop::kPollOut : 0));
+  }
+}
+
+void DnsServer::Accept() {
+  for (;;) {
+    int fd = accept4(tcp_fd_, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if (fd < 0) {
+      if (errno != EAGAIN && errno != EWOULDBLOCK) {
+        LOG_ERRNO();
+      }
+      return;
+    }
+    if (conns_.size() >= options_.max_tcp_connections) {
+      close(fd);
+      continue;
+    }
+    int val{1};
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &val, sizeof(val));
+    loop_->TuneSocket(fd);
+    auto conn = std::make_shared<Connection>();
+    conn->fd = fd;
+    conn->active = EventLoop::Clock::now();
+    Connection *raw = conn.get();
+    conns_.insert({fd, std::move(conn)});
+    loop_->Add(fd, EventLoop::kPollIn | EventLoop::kPollHup,
+               [this, raw](int, uint32_t events) { OnTcp(raw, events); });
+    ExpireTcp(conns_.at(fd));
+  }
+}
+
+void DnsServer::ExpireTcp(const std::weak_ptr<Connection> &weak) {
+  auto conn = weak.lock();
+  if (conn == nullptr) {
+    return;
+  }
+  auto idle = EventLoop::Clock::now() - conn->active;
+  if (idle >= options_.tcp_idle_timeout) {
+    CloseTcp(conn.get());
+    return;
+  }
+  // One timer per connection, re-armed for whatever is left of its timeout.
+  loop_->RunAfter(options_.tcp_idle_timeout - idle,
+                  [w = weak_from_this(), weak] {
+                    if (auto s = w.lock()) {
+                      s->ExpireTcp(weak);
+                    }
+                  });
+}
+
+void DnsServer::OnTcp(Connection *conn, uint32_t events) {
+  if (events & EventLoop::kPollErr) {
+    CloseTcp(conn);
+    return;
+  }
+  if ((events & (EventLoop::kPollIn | EventLoop::kPollHup)) &&
+      !ReadTcp(conn)) {
+    return;
+  }
+  FlushTcp(conn);
+}
+
+bool DnsServer::ReadTcp(Connection *conn) {
+  bool eof{};
+  for (;;) {
+    size_t len = conn->rbuf.size();
+    conn->rbuf.resize(len + kReadChunk);
+    auto n = read(conn->fd, conn->rbuf.data() + len, kReadChunk);
+    conn->rbuf.resize(len + std::max<ssize_t>(n, 0));
+    if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+      break;
+    }
+    if (n <= 0) {
+      LOG_ERRNO_IF(n < 0);
+      eof = true;
+      break;
+    }
+  }
+
+  // Answers from cache are queued while dispatching and written together.
+  conn->dispatching = true;
+  Client client{};
+  client.tcp = true;
+  client.conn = conns_.at(conn->fd);
+  size_t offset = 0;
+  const auto *p = reinterpret_cast<const uint8_t *>(conn->rbuf.data());
+  while (conn->rbuf.size() - offset >= sizeof(uint16_t)) {
+    size_t len = str::LoadBigEndian<uint16_t>(p + offset);
+    if (conn->rbuf.size() - offset - sizeof(uint16_t) < len) {
+      break;
+    }
+    Handle({conn->rbuf.data() + offset + sizeof(uint16_t), len}, client);
+    offset += sizeof(uint16_t) + len;
+    conn->active = EventLoop::Clock::now();
+  }
+  conn->rbuf.erase(0, offset);
+  conn->dispatching = false;
+
+  if (eof) {
+    // Answers still being resolved are dropped with the connection.
+    if (FlushTcp(conn)) {
+      CloseTcp(conn);
+    }
+    return false;
+  }
+  return true;
+}
+
+bool DnsServer::FlushTcp(Connection *conn) {
+  while (!conn->wbuf.empty()) {
+    auto n = write(conn->fd, conn->wbuf.data(), conn->wbuf.size());
+    if (n < 0) {
+      if (errno == EAGAIN || errno == EWOULDBLOCK) {
+        break;
+      }
+      LOG_ERRNO();
+      CloseTcp(conn);
+      return false;
+    }
+    conn->wbuf.erase(0, n);
+  }
+  uint32_t events = EventLoop::kPollIn | EventLoop::kPollHup;
+  if (!conn->wbuf.empty()) {
+    events |= EventLoop::kPollOut;
+  }
+  loop_->Modify(conn->fd, events);
+  return true;
+}
+
+void DnsServer::CloseTcp(Connection *conn) {
+  int fd = conn->fd;
+  loop_->Remove(fd);
+  close(fd);
+  conns_.erase(fd);
+}
+
+void DnsServer::Handle(std::string_view message, Client client) {
+  HeaderSection header{};
+  bool ok{};
+  header.Deserialize(message, &ok);
+  // Responses are never answered, so that two servers cannot loop.
+  if (!ok || header.flags.qr) {
+    return;
+  }
+  QuestionSection parsed{};
+  size_t question_size =
+      header.questions == 1 ? parsed.Deserialize(message, HeaderSection::kSize)
+                            : 0;
+  std::string_view wire = message.substr(HeaderSection::kSize, question_size);
+  // Answered with an OPT of our own (RFC 6891 6.1.1).
+  client.edns = question_size != 0 && header.additional_rr > 0 &&
+                HasOptRecord(message, HeaderSection::kSize + question_size);
+
+  ResponseCode rcode = ResponseCode::kNoError;
+  if (header.flags.op_code != 0) {
+    rcode = ResponseCode::kNotImp;
+  } else if (question_size == 0) {
+    rcode = ResponseCode::kFormErr;
+  } else if (parsed.bin.qclass != RecordClass::kIn) {
+    rcode = ResponseCode::kNotImp;
+  }
+  if (rcode != ResponseCode::kNoError) {
+    Reply(client, SerializeDnsResponse(header.request_id, header.flags.rd,
+                                       wire, rcode));
+    return;
+  }
+
+  Question question{header.request_id, header.flags.rd, parsed.bin.qtype,
+                    ToLower(parsed.qname), std::string{wire}};
+  const auto *entry = cache_.Find(Key(question));
+  if (entry == nullptr || entry->value.question_size != wire.size()) {
+    IpAddress ip{};
+    if (question.qtype == RecordType::A) {
+      Forward(std::move(question), client);
+    } else if (question.qtype == RecordType::AAAA &&
+               resolver_->FindLocal(question.name, &ip) && !ip.IsV4()) {
+      Respond(question, client, ResponseCode::kNoError, ip,
+              options_.local_ttl);
+    } else {
+      Relay(std::move(question), client);
+    }
+    return;
+  }
+  // Counted by the resolver too, so that hot names are refreshed ahead.
+  resolver_->Touch(question.name);
+  std::vector<uint8_t> out = entry->value.message;
+  str::StoreBigEndian(question.id, out.data());
+  out[kFlagsOffset] = question.rd ? out[kFlagsOffset] | kRdBit
+                                  : out[kFlagsOffset] & ~kRdBit;
+  memcpy(out.data() + HeaderSection::kSize, wire.data(), wire.size());
+  // Every record ages alike; none outlives the entry.
+  auto ttl = std::chrono::ceil<std::chrono::seconds>(
+      entry->expire - AnswerCache::Clock::now());
+  for (size_t offset : entry->value.ttl_offsets) {
+    str::StoreBigEndian(static_cast<uint32_t>(ttl.count()),
+                        out.data() + offset);
+  }
+  Reply(client, std::move(out));
+}
+
+void DnsServer::Forward(Question question, const Client &client) {
+  auto callback = [w = weak_from_this(), question, client](
+                      const IpAddress &ip, ResponseCode rcode,
+                      std::chrono::seconds ttl, const std::string &error) {
+    auto s = w.lock();
+    if (s == nullptr) {
+      return;
+    }
+    if (rcode == ResponseCode::kServFail) {
+      s->Reply(client,
+               SerializeDnsResponse(question.id, question.rd, question.wire,
+                                    rcode));
+      return;
+    }
+    // NXDOMAIN, or NODATA: the name has no A record.
+    if (!error.empty()) {
+      s->Respond(question, client, rcode, {},
+                 static_cast<uint32_t>(ttl.count()));
+      return;
+    }
+    // An IPv6 literal or /etc/hosts entry says nothing of the A records.
+    if (!ip.IsV4()) {
+      s->Relay(question, client);
+      return;
+    }
+    // Answers with a zero TTL are not cached, and are passed on uncached.
+    s->Respond(question, client, rcode, ip,
+               ttl == DnsResolver::kNoExpiry
+                   ? s->options_.local_ttl
+                   : static_cast<uint32_t>(ttl.count()));
+  };
+  resolver_->Lookup(question.name, std::move(callback));
+}
+
+void DnsServer::Respond(const Question &question, const Client &client,
+                        ResponseCode rcode, const IpAddress &ip,
+                        uint32_t ttl) {
+  auto message = SerializeDnsResponse(question.id, question.rd, question.wire,
+                                      rcode, ip, ttl);
+  std::vector<size_t> ttl_offsets{};
+  if (!ip.Empty()) {
+    ttl_offsets.push_back(HeaderSection::kSize + question.wire.size() +
+                          kAnswerTtlOffset);
+  }
+  Store(question, message, std::move(ttl_offsets), ttl);
+  Reply(client, std::move(message));
+}
+
+void DnsServer::Relay(Question question, const Client &client) {
+  if (upstreams_.empty() || relays_.size() >= kMaxRelays) {
+    Reply(client, SerializeDnsResponse(question.id, question.rd, question.wire,
+                                       ResponseCode::kServFail));
+    return;
+  }
+  uint16_t id{};
+  do {
+    id = static_cast<uint16_t>(rand());
+  } while (relays_.contains(id));
+
+  // The client's question as is, under our id and OPT.
+  HeaderSection header{};
+  header.request_id = id;
+  header.flags.rd = true;
+  header.questions = 1;
+  std::vector<uint8_t> query(HeaderSection::kSize + question.wire.size());
+  header.Pack(query.data());
+  memcpy(query.data() + HeaderSection::kSize, question.wire.data(),
+         question.wire.size());
+  AppendOptRecord(kDefaultEdnsPayloadSize, &query);
+  size_t sent = 0;
+  for (const auto &server : upstreams_) {
+    if (sendto(relay_fd_, query.data(), query.size(), 0,
+               reinterpret_cast<const sockaddr *>(&server),
+               sizeof(server)) < 0) {
+      LOG_ERRNO();
+      continue;
+    }
+    ++sent;
+  }
+  if (sent == 0) {
+    Reply(client, SerializeDnsResponse(question.id, question.rd, question.wire,
+                                       ResponseCode::kServFail));
+    return;
+  }
+  uint64_t seq = ++relay_seq_;
+  relays_.insert({id, {std::move(question), client, sent, seq}});
+  loop_->RunAfter(options_.relay_timeout, [w = weak_from_this(), id, seq] {
+    if (auto s = w.lock()) {
+      s->ExpireRelay(id, seq);
+    }
+  });
+}
+
+void DnsServer::OnRelay() {
+  for (size_t i = 0; i < options_.batch_size; ++i) {
+    sockaddr_in from{};
+    socklen_t len = sizeof(from);
+    auto n = recvfrom(relay_fd_, relay_buf_.data(), relay_buf_.size(), 0,
+                      reinterpret_cast<sockaddr *>(&from), &len);
+    if (n < 0) {
+      if (errno != EAGAIN && errno != EWOULDBLOCK) {
+        LOG_ERRNO();
+      }
+      return;
+    }
+    Relayed({relay_buf_.data(), static_cast<size_t>(n)}, from);
+  }
+}
+
+void DnsServer::Relayed(std::string_view message, const sockaddr_in &from) {
+  HeaderSection header{};
+  bool ok{};
+  header.Deserialize(message, &ok);
+  if (!ok || !header.flags.qr) {
+    return;
+  }
+  auto it = relays_.find(header.request_id);
+  if (it == relays_.end()) {
+    return;
+  }
+  // Only from a server we asked, and to the question we asked; the name may
+  // come back in another letter case (RFC 4343).
+  const std::string &wire = it->second.question.wire;
+  size_t name_size = wire.size() - sizeof(RecordType) - sizeof(RecordClass);
+  std::string_view echoed = message.substr(HeaderSection::kSize, wire.size());
+  if (std::none_of(upstreams_.begin(), upstreams_.end(),
+                   [&from](const sockaddr_in &server) {
+                     return server.sin_addr.s_addr == from.sin_addr.s_addr &&
+                            server.sin_port == from.sin_port;
+                   }) ||
+      header.questions != 1 || echoed.size() != wire.size() ||
+      !str::EqualsIgnoreCase(echoed.substr(0, name_size),
+                             std::string_view{wire}.substr(0, name_size)) ||
+      echoed.substr(name_size) != std::string_view{wire}.substr(name_size)) {
+    return;
+  }
+
+  DnsResponse parsed{};
+  std::vector<uint8_t> answer(message.begin(), message.end());
+  std::vector<size_t> ttl_offsets{};
+  ok = parsed.Deserialize(message) && StripOptRecord(&answer, &ttl_offsets);
+  auto rcode = parsed.Rcode();
+  bool failed = !ok || (rcode != ResponseCode::kNoError &&
+                        rcode != ResponseCode::kNxDomain);
+  // One server's failure is not the answer while others may still give it.
+  if (failed && it->second.servers > 1) {
+    --it->second.servers;
+    return;
+  }
+  Question question = std::move(it->second.question);
+  Client client = it->second.client;
+  relays_.erase(it);
+  if (!ok) {
+    Reply(client, SerializeDnsResponse(question.id, question.rd, question.wire,
+                                       ResponseCode::kServFail));
+    return;
+  }
+
+  str::StoreBigEndian(question.id, answer.data());
+  answer[kFlagsOffset] = question.rd ? answer[kFlagsOffset] | kRdBit
+                                     : answer[kFlagsOffset] & ~kRdBit;
+  memcpy(answer.data() + HeaderSection::kSize, question.wire.data(),
+         question.wire.size());
+  // Cached until its shortest-lived record expires; negative answers as
+  // long as their SOA allows. Failures and truncated answers are not.
+  uint32_t ttl{};
+  if (!failed && !parsed.header.flags.tc && parsed.records.empty()) {
+    ttl = parsed.NegativeTtl();
+  } else if (!failed && !parsed.header.flags.tc) {
+    ttl = UINT32_MAX;
+    for (const auto *section :
+         {&parsed.records, &parsed.authorities, &parsed.additionals}) {
+      for (const auto &r : *section) {
+        if (r.bin.type != RecordType::OPT) {
+          ttl = std::min(ttl, static_cast<uint32_t>(std::max(r.bin.ttl, 0)));
+        }
+      }
+    }
+  }
+  Store(question, answer, std::move(ttl_offsets), ttl);
+  Reply(client, std::move(answer));
+}
+
+void DnsServer::ExpireRelay(uint16_t id, uint64_t seq) {
+  auto it = relays_.find(id);
+  if (it == relays_.end() || it->second.seq != seq) {
+    return;
+  }
+  Question question = std::move(it->second.question);
+  Client client = it->second.client;
+  relays_.erase(it);
+  spdlog::warn("[DnsServer.ExpireRelay] relay timed out, name={}",
+               question.name);
+  Reply(client, SerializeDnsResponse(question.id, question.rd, question.wire,
+                                     ResponseCode::kServFail));
+}
+
+void DnsServer::Store(const Question &question,
+                      const std::vector<uint8_t> &message,
+                      std::vector<size_t> ttl_offsets, uint32_t ttl) {
+  if (ttl == 0) {
+    return;
+  }
+  Answer answer{message, question.wire.size(), std::move(ttl_offsets)};
+  str::StoreBigEndian(uint16_t{}, answer.message.data());
+  cache_.Put(Key(question), answer, std::chrono::seconds{ttl});
+}
+
+void DnsServer::Reply(const Client &client, std::vector<uint8_t> message) {
+  // Cached answers never carry the OPT, which depends on the query.
+  if (client.edns) {
+    AppendOptRecord(kDefaultEdnsPayloadSize, &message);
+  }
+  // Too large for the client's UDP: the question alone with TC set, so
+  // that it asks again over TCP.
+  if (!client.tcp && message.size() > (client.edns ? kDefaultEdnsPayloadSize
+                                                   : kMaxPlainUdpAnswer)) {
+    QuestionSection question{};
+    message.resize(HeaderSection::kSize +
+                   question.Deserialize(
+                       {reinterpret_cast<const char *>(message.data()),
+                        message.size()},
+                       HeaderSection::kSize));
+    message[kFlagsOffset] |= kTcBit;
+    // ANCOUNT, NSCOUNT and ARCOUNT end the header.
+    std::fill(message.begin() + HeaderSection::kSize - 3 * sizeof(uint16_t),
+              message.begin() + HeaderSection::kSize, 0);
+    if (client.edns) {
+      AppendOptRecord(kDefaultEdnsPayloadSize, &message);
+    }
+  }
+  if (client.tcp) {
+    auto conn = client.conn.lock();
+    if (conn == nullptr || message.size() > UINT16_MAX) {
+      return;
+    }
+    uint8_t prefix[sizeof(uint16_t)];
+    str::StoreBigEndian(static_cast<uint16_t>(message.size()), prefix);
+    conn->wbuf.append(reinterpret_cast<const char *>(prefix), sizeof(prefix));
+    conn->wbuf.append(message.begin(), message.end());
+    conn->active = EventLoop::Clock::now();
+    if (!conn->dispatching) {
+      FlushTcp(conn.get());
+    }
+    return;
+  }
+
+  if (udp_out_.size() >= kMaxPendingDatagrams) {
+    return;
+  }
+  udp_out_.push_back({client.addr, std::move(message)});
+  if (dispatching_ || flush_posted_ || udp_blocked_) {
+    return;
+  }
+  // Answers the resolver delivers in one go leave in one sendmmsg().
+  flush_posted_ = loop_->Post([w = weak_from_this()] {
+    if (auto s = w.lock()) {
+      s->flush_posted_ = false;
+      s->FlushUdp();
+    }
+  });
+  if (!flush_posted_) {
+    FlushUdp();
+  }
+}
+
+std::string DnsServer::Key(const Question &question) {
+  std::string key{std::to_string(static_cast<uint16_t>(question.qtype))};
+  key += ' ';
+  key += question.name;
+  return key;
+}
+
+}  // namespace boots
@@ -0,0 +1,248 @@
+#include "dns_tcp_transport.h"
+
+#include <netinet/tcp.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstdlib>
+
+#include "boots/event_loop.h"
+#include "log.h"
+#include "util.h"
+
+namespace boots {
+
+static constexpr size_t kReadChunk = 16 * 1024;
+
+DnsTcpTransport::DnsTcpTransport(EventLoop *loop, ResponseFunc on_response,
+                                 FailureFunc on_failure,
+                                 size_t connections_per_server)
+    : loop_{loop},
+      on_response_{std::move(on_response)},
+      failures_{std::make_shared<Failures>(std::move(on_failure))},
+      connections_per_server_{std::max<size_t>(connections_per_server, 1)} {}
+
+DnsTcpTransport::~DnsTcpTransport() {
+  for (auto &[key, pool] : pools_) {
+    for (auto &conn : pool) {
+      loop_->Remove(conn->fd);
+      close(conn->fd);
+    }
+  }
+}
+
+void DnsTcpTransport::Send(const sockaddr_in &server,
+                           std::vector<uint8_t> query) {
+  if (query.size() < sizeof(uint16_t) || query.size() > UINT16_MAX) {
+    return;
+  }
+  Connection *conn = Pick(server);
+  if (conn == nullptr) {
+    Fail({std::move(query)});
+    return;
+  }
+  Enqueue(conn, {std::move(query)});
+}
+
+DnsTcpTransport::Connection *DnsTcpTransport::Pick(const sockaddr_in &server) {
+  Pool &pool = pools_[Key(server)];
+  Connection *best{};
+  for (auto &conn : pool) {
+    if (best == nullptr || conn->pending.size() < best->pending.size()) {
+      best = conn.get();
+    }
+  }
+  // Pipelining keeps one connection busy; open another only while every
+  // existing one already has answers outstanding.
+  if (best != nullptr &&
+      (best->pending.empty() || pool.size() >= connections_per_server_)) {
+    return best;
+  }
+  Connection *conn = Connect(server, &pool);
+  return conn != nullptr ? conn : best;
+}
+
+DnsTcpTransport::Connection *DnsTcpTransport::Connect(const sockaddr_in &server,
+                                                      Pool *pool) {
+  int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC,
+                  IPPROTO_TCP);
+  if (fd < 0) {
+    LOG_ERRNO();
+    return nullptr;
+  }
+  int val{1};
+  setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &val, sizeof(val));
+  auto n = connect(fd, reinterpret_cast<const sockaddr *>(&server),
+                   sizeof(server));
+  if (n != 0 && errno != EINPROGRESS) {
+    LOG_ERRNO();
+    close(fd);
+    return nullptr;
+  }
+
+  auto conn = std::make_unique<Connection>();
+  conn->fd = fd;
+  conn->connected = n == 0;
+  conn->server = server;
+  Connection *raw = conn.get();
+  pool->push_back(std::move(conn));
+  loop_->Add(fd, EventLoop::kPollIn | EventLoop::kPollOut | EventLoop::kPollHup,
+             [this, raw](int, uint32_t events) { OnEvent(raw, events); });
+  return raw;
+}
+
+void DnsTcpTransport::Enqueue(Connection *conn, Query query) {
+  uint16_t id = str::LoadBigEndian<uint16_t>(query.data.data());
+  // Answers are matched to queries by id, so ids outstanding on one
+  // connection must differ; the owner matches answers by question instead.
+  while (conn->pending.contains(id)) {
+    id = static_cast<uint16_t>(rand());
+    str::StoreBigEndian(id, query.data.data());
+  }
+  uint8_t prefix[sizeof(uint16_t)];
+  str::StoreBigEndian(static_cast<uint16_t>(query.data.size()), prefix);
+  conn->wbuf.append(reinterpret_cast<const char *>(prefix), sizeof(prefix));
+  conn->wbuf.append(query.data.begin(), query.data.end());
+  conn->pending.emplace(id, std::move(query));
+  if (conn->connected && !conn->dispatching) {
+    Flush(conn);
+  }
+}
+
+void DnsTcpTransport::OnEvent(Connection *conn, uint32_t events) {
+  if (events & EventLoop::kPollErr) {
+    Close(conn, true);
+    return;
+  }
+  if (!conn->connected && (events & EventLoop::kPollOut)) {
+    int err{};
+    socklen_t len = sizeof(err);
+    getsockopt(conn->fd, SOL_SOCKET, SO_ERROR, &err, &len);
+    if (err != 0) {
+      SPDLOG_ERROR("[DnsTcpTransport] connect failed, errno={}({})", err,
+                   std::strerror(err));
+      Close(conn, false);
+      return;
+    }
+    conn->connected = true;
+  }
+  if ((events & (EventLoop::kPollIn | EventLoop::kPollHup)) && !Read(conn)) {
+    return;
+  }
+  if (conn->connected) {
+    Flush(conn);
+  }
+}
+
+bool DnsTcpTransport::Flush(Connection *conn) {
+  while (!conn->wbuf.empty()) {
+    auto n = write(conn->fd, conn->wbuf.data(), conn->wbuf.size());
+    if (n < 0) {
+      if (errno == EAGAIN || errno == EWOULDBLOCK) {
+        break;
+      }
+      LOG_ERRNO();
+      Close(conn, true);
+      return false;
+    }
+    conn->wbuf.erase(0, n);
+  }
+  uint32_t events = EventLoop::kPollIn | EventLoop::kPollHup;
+  if (!conn->wbuf.empty()) {
+    events |= EventLoop::kPollOut;
+  }
+  loop_->Modify(conn->fd, events);
+  return true;
+}
+
+bool DnsTcpTransport::Read(Connection *conn) {
+  bool eof{};
+  for (;;) {
+    size_t len = conn->rbuf.size();
+    conn->rbuf.resize(len + kReadChunk);
+    auto n = read(conn->fd, conn->rbuf.data() + len, kReadChunk);
+    conn->rbuf.resize(len + std::max<ssize_t>(n, 0));
+    if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+      break;
+    }
+    if (n <= 0) {
+      LOG_ERRNO_IF(n < 0);
+      eof = true;
+      break;
+    }
+  }
+
+  // Answers may queue more queries on this connection; they are flushed by
+  // the caller once dispatch is over.
+  conn->dispatching = true;
+  size_t offset = 0;
+  const auto *p = reinterpret_cast<const uint8_t *>(conn->rbuf.data());
+  while (conn->rbuf.size() - offset >= sizeof(uint16_t)) {
+    size_t len = str::LoadBigEndian<uint16_t>(p + offset);
+    if (conn->rbuf.size() - offset - sizeof(uint16_t) < len) {
+      break;
+    }
+    std::string_view message{conn->rbuf.data() + offset + sizeof(uint16_t),
+                             len};
+    offset += sizeof(uint16_t) + len;
+    if (len >= sizeof(uint16_t)) {
+      conn->pending.erase(str::LoadBigEndian<uint16_t>(
+          reinterpret_cast<const uint8_t *>(message.data())));
+      on_response_(message);
+    }
+  }
+  conn->rbuf.erase(0, offset);
+  conn->dispatching = false;
+
+  if (eof) {
+    Close(conn, true);
+    return false;
+  }
+  return true;
+}
+
+void DnsTcpTransport::Close(Connection *conn, bool retry) {
+  loop_->Remove(conn->fd);
+  close(conn->fd);
+
+  auto pending = std::move(conn->pending);
+  sockaddr_in server = conn->server;
+  Pool &pool = pools_[Key(server)];
+  std::erase_if(pool, [conn](const auto &c) { return c.get() == conn; });
+
+  // Servers may close idle or busy connections at any time (RFC 7766 6.2.3);
+  // unanswered queries get one more attempt on a fresh connection.
+  for (auto &[id, query] : pending) {
+    Connection *next = retry && !query.retried ? Pick(server) : nullptr;
+    if (next == nullptr) {
+      Fail(std::move(query));
+      continue;
+    }
+    query.retried = true;
+    Enqueue(next, std::move(query));
+  }
+}
+
+void DnsTcpTransport::Fail(Query query) {
+  failures_->queries.push_back(std::move(query.data));
+  if (failures_->queries.size() > 1) {
+    return;
+  }
+  // Deferred, so that the owner never sees a failure from inside Send(). A
+  // timer rather than Post(), which may be full.
+  loop_->RunAfter({}, [failures = failures_] {
+    auto queries = std::move(failures->queries);
+    failures->queries.clear();
+    for (const auto &data : queries) {
+      failures->on_failure(
+          {reinterpret_cast<const char *>(data.data()), data.size()});
+    }
+  });
+}
+
+uint64_t DnsTcpTransport::Key(const sockaddr_in &server) {
+  return static_cast<uint64_t>(server.sin_addr.s_addr) << 16 |
+         server.sin_port;
+}
+
+}  // namespace boots
@@ -0,0 +1,75 @@
+#pragma once
+#include <arpa/inet.h>
+
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+namespace boots {
+class EventLoop;
+
+// DNS over TCP (RFC 7766) with a small pool of persistent connections per
+// upstream. Queries are length-prefixed and pipelined: a connection carries
+// any number of outstanding ids, and answers are delivered in arrival order.
+// A query that cannot be sent, or is lost with its connection after its one
+// retry, is handed to `on_failure`, always from the loop rather than from
+// within Send().
+class DnsTcpTransport {
+ public:
+  using ResponseFunc = std::function<void(std::string_view message)>;
+  using FailureFunc = std::function<void(std::string_view query)>;
+
+  DnsTcpTransport(EventLoop *loop, ResponseFunc on_response,
+                  FailureFunc on_failure, size_t connections_per_server = 2);
+  ~DnsTcpTransport();
+
+  DnsTcpTransport(const DnsTcpTransport &) = delete;
+  DnsTcpTransport &operator=(const DnsTcpTransport &) = delete;
+
+  void Send(const sockaddr_in &server, std::vector<uint8_t> query);
+
+ private:
+  struct Query {
+    std::vector<uint8_t> data;
+    bool retried{};
+  };
+  struct Connection {
+    int fd{-1};
+    bool connected{};
+    bool dispatching{};
+    sockaddr_in server{};
+    std::string rbuf{};
+    std::string wbuf{};
+    // Unanswered queries by id, resent once if the server closes early.
+    std::unordered_map<uint16_t, Query> pending{};
+  };
+  using Pool = std::vector<std::unique_ptr<Connection>>;
+  // Failed queries waiting for the loop to report them. Shared with the
+  // task that drains it, which may run after we are gone.
+  struct Failures {
+    FailureFunc on_failure;
+    std::vector<std::vector<uint8_t>> queries{};
+  };
+
+  Connection *Pick(const sockaddr_in &server);
+  Connection *Connect(const sockaddr_in &server, Pool *pool);
+  void Enqueue(Connection *conn, Query query);
+  void OnEvent(Connection *conn, uint32_t events);
+  bool Flush(Connection *conn);
+  bool Read(Connection *conn);
+  void Close(Connection *conn, bool retry);
+  void Fail(Query query);
+
+  static uint64_t Key(const sockaddr_in &server);
+
+  EventLoop *loop_;
+  ResponseFunc on_response_;
+  std::shared_ptr<Failures> failures_;
+  size_t connections_per_server_;
+  std::unordered_map<uint64_t, Pool> pools_{};
+};
+}  // namespace boots
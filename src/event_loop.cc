@@ -1,16 +1,47 @@
 #include "boots/event_loop.h"
 #include <spdlog/spdlog.h>
+#include <algorithm>
+#include <linux/mempolicy.h>
+#include <pthread.h>
 #include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
 #include <unistd.h>
 
 namespace boots {
 
-static int kPollTime = 10;
+// Posted tasks run per iteration before polling again, so a flood of posts
+// cannot starve I/O.
+static constexpr size_t kMaxTaskBatch = 256;
 uint32_t EventLoop::kPollIn = EPOLLIN;
+uint32_t EventLoop::kPollOut = EPOLLOUT;
 uint32_t EventLoop::kPollErr = EPOLLERR;
+uint32_t EventLoop::kPollHup = EPOLLHUP | EPOLLRDHUP;
 
-EventLoop::EventLoop() : epoll_fd_{} { epoll_fd_ = epoll_create1(0); }
-EventLoop::~EventLoop() { close(epoll_fd_); };
+EventLoop::EventLoop(const EventLoopOptions &options)
+    : options_{options},
+      epoll_fd_{},
+      wakeup_fd_{},
+      tasks_{options.task_queue_size} {
+  epoll_fd_ = epoll_create1(0);
+  wakeup_fd_ = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  Add(wakeup_fd_, kPollIn, [](int fd, uint32_t) {
+    uint64_t val{};
+    while (read(fd, &val, sizeof(val)) > 0) {
+    }
+  });
+}
+EventLoop::~EventLoop() {
+  // Handlers may own objects that Remove() their fds when destroyed.
+  auto handlers = std::move(fd_handlers_);
+  handlers.clear();
+  TaskFunc task{};
+  while (tasks_.Pop(&task)) {
+  }
+  close(wakeup_fd_);
+  close(epoll_fd_);
+}
 
 void EventLoop::Add(int fd, uint32_t events, CallbackFunc callback) {
   fd_handlers_.insert({fd, {fd, callback}});
@@ -38,12 +69,132 @@ void EventLoop::Remove(int fd) {
   }
 }
 
-void EventLoop::Stop() { stopping_ = true; }
+void EventLoop::RunAfter(Clock::duration delay, TaskFunc task) {
+  timers_.push_back({Clock::now() + delay, timer_seq_++, std::move(task)});
+  std::push_heap(timers_.begin(), timers_.end());
+}
+
+bool EventLoop::Post(TaskFunc task) {
+  if (!tasks_.Push(std::move(task))) {
+    return false;
+  }
+  Wakeup();
+  return true;
+}
+
+void EventLoop::Stop() {
+  stopping_.store(true, std::memory_order_release);
+  Wakeup();
+}
+
+void EventLoop::Wakeup() {
+  // Pairs with the fence in Wait(): either the loop sees the new work before
+  // it blocks, or this sees it asleep.
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+  if (!sleeping_.load(std::memory_order_relaxed) ||
+      !sleeping_.exchange(false, std::memory_order_relaxed)) {
+    return;
+  }
+  uint64_t one{1};
+  if (write(wakeup_fd_, &one, sizeof(one)) < 0) {
+    spdlog::error("[EventLoop] wakeup failed, errno={}", strerror(errno));
+  }
+}
+
+void EventLoop::RunTasks() {
+  TaskFunc task{};
+  for (size_t i = 0; i < kMaxTaskBatch && tasks_.Pop(&task); ++i) {
+    task();
+  }
+}
+
+void EventLoop::TuneSocket(int fd) const {
+  if (options_.busy_poll.count() > 0) {
+    int usecs = static_cast<int>(options_.busy_poll.count());
+    if (setsockopt(fd, SOL_SOCKET, SO_BUSY_POLL, &usecs, sizeof(usecs)) != 0) {
+      spdlog::debug("[EventLoop] busy poll failed, fd={}, errno={}", fd,
+                    strerror(errno));
+    }
+  }
+  if (options_.cpu >= 0) {
+    int cpu = options_.cpu;
+    if (setsockopt(fd, SOL_SOCKET, SO_INCOMING_CPU, &cpu, sizeof(cpu)) != 0) {
+      spdlog::debug("[EventLoop] incoming cpu failed, fd={}, errno={}", fd,
+                    strerror(errno));
+    }
+  }
+}
+
+int EventLoop::PollTimeout() const {
+  int interval = static_cast<int>(options_.poll_interval.count());
+  if (timers_.empty()) {
+    return interval;
+  }
+  auto wait = std::chrono::ceil<std::chrono::milliseconds>(
+      timers_.front().deadline - Clock::now());
+  return static_cast<int>(std::clamp<int64_t>(wait.count(), 0, interval));
+}
+
+int EventLoop::Wait(epoll_event *events, int max_events) {
+  if (options_.spin_budget.count() > 0) {
+    auto deadline = Clock::now() + options_.spin_budget;
+    for (;;) {
+      int cnt{epoll_wait(epoll_fd_, events, max_events, 0)};
+      if (cnt != 0) {
+        return cnt;
+      }
+      auto now = Clock::now();
+      if (now >= deadline || !tasks_.Empty() ||
+          stopping_.load(std::memory_order_relaxed) ||
+          (!timers_.empty() && timers_.front().deadline <= now)) {
+        break;
+      }
+    }
+  }
+  sleeping_.store(true, std::memory_order_relaxed);
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+  bool idle = tasks_.Empty() && !stopping_.load(std::memory_order_relaxed);
+  int cnt{epoll_wait(epoll_fd_, events, max_events, idle ? PollTimeout() : 0)};
+  sleeping_.store(false, std::memory_order_relaxed);
+  return cnt;
+}
+
+void EventLoop::RunTimers() {
+  auto now = Clock::now();
+  while (!timers_.empty() && timers_.front().deadline <= now) {
+    std::pop_heap(timers_.begin(), timers_.end());
+    auto task = std::move(timers_.back().task);
+    timers_.pop_back();
+    task();
+  }
+}
+
+void EventLoop::ApplyPlacement() {
+  if (options_.cpu >= 0) {
+    cpu_set_t set{};
+    CPU_ZERO(&set);
+    CPU_SET(options_.cpu, &set);
+    int err = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+    if (err != 0) {
+      spdlog::error("[EventLoop] pin failed, cpu={}, errno={}", options_.cpu,
+                    strerror(err));
+    }
+  }
+  // MPOL_LOCAL allocates on the node of the allocating CPU, which for a
+  // pinned loop is fixed; pages are placed when first touched, so pools
+  // filled from the loop land next to it.
+  if (options_.numa_local &&
+      syscall(SYS_set_mempolicy, MPOL_LOCAL, nullptr, 0) != 0) {
+    spdlog::error("[EventLoop] set mempolicy failed, errno={}",
+                  strerror(errno));
+  }
+}
 
 void EventLoop::Run() {
+  ApplyPlacement();
   std::array<epoll_event, 1> evs{};
-  while (!stopping_) {
-    int cnt{epoll_wait(epoll_fd_, evs.data(), 1, kPollTime)};
+  while (!stopping_.load(std::memory_order_acquire)) {
+    int cnt{Wait(evs.data(), static_cast<int>(evs.size()))};
     if (cnt == -1) {
       spdlog::error("[EventLoop] poll, errno={}", errno);
       continue;
@@ -54,8 +205,12 @@ void EventLoop::Run() {
       if (it == fd_handlers_.end()) {
         continue;
       }
-      it->second.second(evs[i].data.fd, evs[i].events);
+      // The handler may remove its own fd, so it must outlive the call.
+      auto handler = it->second.second;
+      handler(evs[i].data.fd, evs[i].events);
     }
+    RunTasks();
+    RunTimers();
   }
 }
 
@@ -0,0 +1,54 @@
+#include "frequency_sketch.h"
+
+#include <algorithm>
+#include <array>
+#include <bit>
+#include <functional>
+#include <limits>
+
+namespace boots {
+
+static constexpr std::array<size_t, 4> kRowSeeds{
+    0x9E3779B97F4A7C15ULL, 0xC2B2AE3D27D4EB4FULL, 0x165667B19E3779F9ULL,
+    0xD6E8FEB86659FD93ULL};
+
+FrequencySketch::FrequencySketch(size_t width)
+    : mask_{std::bit_ceil(std::max<size_t>(width, 64)) - 1},
+      sample_size_{(mask_ + 1) * 10},
+      counters_((mask_ + 1) * kDepth) {}
+
+void FrequencySketch::Add(std::string_view key) {
+  size_t hash = std::hash<std::string_view>{}(key);
+  for (size_t row = 0; row < kDepth; ++row) {
+    uint8_t &counter = counters_[Index(row, hash)];
+    if (counter != std::numeric_limits<uint8_t>::max()) {
+      ++counter;
+    }
+  }
+  if (++additions_ >= sample_size_) {
+    Age();
+  }
+}
+
+uint32_t FrequencySketch::Estimate(std::string_view key) const {
+  size_t hash = std::hash<std::string_view>{}(key);
+  uint8_t res = std::numeric_limits<uint8_t>::max();
+  for (size_t row = 0; row < kDepth; ++row) {
+    res = std::min(res, counters_[Index(row, hash)]);
+  }
+  return res;
+}
+
+size_t FrequencySketch::Index(size_t row, size_t hash) const {
+  size_t h = (hash ^ kRowSeeds[row]) * kRowSeeds[kDepth - 1 - row];
+  return row * (mask_ + 1) + ((h >> 32 ^ h) & mask_);
+}
+
+void FrequencySketch::Age() {
+  for (auto &counter : counters_) {
+    counter >>= 1;
+  }
+  additions_ /= 2;
+}
+
+}  // namespace boots
@@ -0,0 +1,31 @@
+#pragma once
+
+#include <cstdint>
+#include <string_view>
+#include <vector>
+
+namespace boots {
+
+// Count-min sketch of access frequency with periodic aging, in the style of
+// TinyLFU: after `width * 10` additions every counter is halved so that the
+// estimate tracks recent popularity rather than all-time totals.
+class FrequencySketch {
+ public:
+  explicit FrequencySketch(size_t width = 4096);
+
+  void Add(std::string_view key);
+  [[nodiscard]] uint32_t Estimate(std::string_view key) const;
+
+ private:
+  static constexpr size_t kDepth = 4;
+
+  size_t Index(size_t row, size_t hash) const;
+  void Age();
+
+  size_t mask_;
+  size_t additions_{};
+  size_t sample_size_;
+  std::vector<uint8_t> counters_;
+};
+
+}  // namespace boots
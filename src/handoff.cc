@@ -0,0 +1,353 @@
+#include "boots/handoff.h"
+
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <cstdlib>
+#include <cstring>
+
+#include "boots/event_loop.h"
+#include "log.h"
+#include "util.h"
+
+namespace boots {
+
+static constexpr size_t kMaxHandoffFds = 16;
+// Bounds how long the successor blocks on a stalled predecessor.
+static constexpr timeval kHandoffTimeout{5, 0};
+// Bounds how long the running process waits for a stalled successor.
+static constexpr auto kSessionTimeout = std::chrono::seconds{5};
+static constexpr size_t kHandoffHeaderSize = sizeof(uint64_t);
+static constexpr uint8_t kHandoffAck = 1;
+
+struct HandoffListener::Session {
+  int fd{-1};
+  uint64_t seq{};
+  std::vector<int> fds{};
+  // The length header, which carries the fds, followed by the data.
+  std::string out{};
+  size_t sent{};
+};
+
+static bool ToUnixAddr(const std::string &path, sockaddr_un *sa) {
+  *sa = {};
+  sa->sun_family = AF_UNIX;
+  if (path.empty() || path.size() >= sizeof(sa->sun_path)) {
+    return false;
+  }
+  memcpy(sa->sun_path, path.data(), path.size());
+  return true;
+}
+
+static void SetTimeouts(int fd) {
+  setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &kHandoffTimeout,
+             sizeof(kHandoffTimeout));
+  setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &kHandoffTimeout,
+             sizeof(kHandoffTimeout));
+}
+
+// Listening sockets and cached state go only to, or come only from, a
+// process of our own user.
+static bool PeerIsUs(int fd) {
+  ucred cred{};
+  socklen_t len = sizeof(cred);
+  if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &len) != 0) {
+    LOG_ERRNO();
+    return false;
+  }
+  if (cred.uid != getuid()) {
+    SPDLOG_ERROR("[Handoff] peer of another user refused, pid={}, uid={}",
+                 cred.pid, cred.uid);
+    return false;
+  }
+  return true;
+}
+
+static bool WriteAll(int fd, const void *data, size_t len) {
+  const auto *p = static_cast<const char *>(data);
+  while (len > 0) {
+    auto n = send(fd, p, len, MSG_NOSIGNAL);
+    if (n <= 0) {
+      LOG_ERRNO();
+      return false;
+    }
+    p += n;
+    len -= n;
+  }
+  return true;
+}
+
+static bool ReadAll(int fd, void *data, size_t len) {
+  auto *p = static_cast<char *>(data);
+  while (len > 0) {
+    auto n = recv(fd, p, len, 0);
+    if (n <= 0) {
+      LOG_ERRNO();
+      return false;
+    }
+    p += n;
+    len -= n;
+  }
+  return true;
+}
+
+// The fds ride on the 8-byte big-endian length of the data, which follows
+// as a plain byte stream. Returns what sendmsg() does.
+static ssize_t SendWithFds(int fd, const std::vector<int> &fds,
+                           const char *header, size_t len) {
+  iovec iov{const_cast<char *>(header), len};
+  alignas(cmsghdr) char control[CMSG_SPACE(sizeof(int) * kMaxHandoffFds)]{};
+  msghdr msg{};
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  if (!fds.empty()) {
+    msg.msg_control = control;
+    msg.msg_controllen = CMSG_SPACE(sizeof(int) * fds.size());
+    cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int) * fds.size());
+    memcpy(CMSG_DATA(cmsg), fds.data(), sizeof(int) * fds.size());
+  }
+  return sendmsg(fd, &msg, MSG_NOSIGNAL);
+}
+
+HandoffListener::HandoffListener(EventLoop *loop, std::string path)
+    : loop_{loop}, path_{std::move(path)} {}
+
+HandoffListener::~HandoffListener() {
+  if (session_ != nullptr) {
+    loop_->Remove(session_->fd);
+    close(session_->fd);
+  }
+  if (fd_ >= 0) {
+    Close();
+    unlink(path_.c_str());
+  }
+}
+
+bool HandoffListener::Init(ProvideFunc provide, TaskFunc handed_over) {
+  sockaddr_un sa{};
+  if (!ToUnixAddr(path_, &sa)) {
+    SPDLOG_ERROR("[HandoffListener] bad path, path={}", path_);
+    return false;
+  }
+  fd_ = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (fd_ < 0) {
+    LOG_ERRNO();
+    return false;
+  }
+  unlink(path_.c_str());
+  if (bind(fd_, reinterpret_cast<const sockaddr *>(&sa), sizeof(sa)) != 0 ||
+      chmod(path_.c_str(), S_IRUSR | S_IWUSR) != 0 || listen(fd_, 1) != 0) {
+    LOG_ERRNO();
+    close(fd_);
+    fd_ = -1;
+    return false;
+  }
+  provide_ = std::move(provide);
+  handed_over_ = std::move(handed_over);
+  loop_->Add(fd_, EventLoop::kPollIn,
+             [h = shared_from_this()](int, uint32_t) { h->Accept(); });
+  return true;
+}
+
+void HandoffListener::Accept() {
+  int fd = accept4(fd_, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+  if (fd < 0) {
+    if (errno != EAGAIN && errno != EWOULDBLOCK) {
+      LOG_ERRNO();
+    }
+    return;
+  }
+  if (session_ != nullptr || !PeerIsUs(fd)) {
+    close(fd);
+    return;
+  }
+  session_ = std::make_unique<Session>();
+  session_->fd = fd;
+  session_->seq = ++session_seq_;
+  std::string data{};
+  provide_(&session_->fds, &data);
+  if (session_->fds.size() > kMaxHandoffFds) {
+    SPDLOG_ERROR("[HandoffListener] too many fds, count={}",
+                 session_->fds.size());
+    session_->fds.clear();
+  }
+  session_->out.resize(kHandoffHeaderSize);
+  str::StoreBigEndian<uint64_t>(
+      data.size(), reinterpret_cast<uint8_t *>(session_->out.data()));
+  session_->out.append(data);
+
+  loop_->Add(fd, EventLoop::kPollOut | EventLoop::kPollHup,
+             [h = shared_from_this()](int, uint32_t events) {
+               h->OnSession(events);
+             });
+  loop_->RunAfter(kSessionTimeout,
+                  [w = weak_from_this(), seq = session_->seq] {
+                    auto h = w.lock();
+                    if (h && h->session_ != nullptr &&
+                        h->session_->seq == seq) {
+                      SPDLOG_ERROR("[HandoffListener] successor timed out");
+                      h->EndSession(false);
+                    }
+                  });
+}
+
+void HandoffListener::OnSession(uint32_t events) {
+  if (session_ == nullptr) {
+    return;
+  }
+  if (events & EventLoop::kPollErr) {
+    EndSession(false);
+    return;
+  }
+  if (session_->sent < session_->out.size()) {
+    if (!SendSession()) {
+      EndSession(false);
+    } else if (session_->sent == session_->out.size()) {
+      loop_->Modify(session_->fd, EventLoop::kPollIn | EventLoop::kPollHup);
+    }
+    return;
+  }
+  uint8_t ack{};
+  auto n = recv(session_->fd, &ack, sizeof(ack), 0);
+  if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+    return;
+  }
+  LOG_ERRNO_IF(n < 0);
+  EndSession(n == sizeof(ack) && ack == kHandoffAck);
+}
+
+bool HandoffListener::SendSession() {
+  Session &session = *session_;
+  while (session.sent < session.out.size()) {
+    ssize_t n{};
+    if (session.sent == 0) {
+      // The fds go out exactly once, with the first byte of the header.
+      n = SendWithFds(session.fd, session.fds, session.out.data(),
+                      kHandoffHeaderSize);
+    } else {
+      n = send(session.fd, session.out.data() + session.sent,
+               session.out.size() - session.sent, MSG_NOSIGNAL);
+    }
+    if (n < 0) {
+      if (errno == EAGAIN || errno == EWOULDBLOCK) {
+        return true;
+      }
+      LOG_ERRNO();
+      return false;
+    }
+    session.sent += n;
+  }
+  return true;
+}
+
+void HandoffListener::EndSession(bool ok) {
+  auto session = std::move(session_);
+  loop_->Remove(session->fd);
+  close(session->fd);
+  if (!ok) {
+    SPDLOG_ERROR("[HandoffListener] successor did not take over");
+    return;
+  }
+  spdlog::info("[HandoffListener.EndSession] handed over, fds={}, bytes={}",
+               session->fds.size(), session->out.size() - kHandoffHeaderSize);
+  // The successor binds the path itself, so it is not unlinked here.
+  Close();
+  std::exchange(handed_over_, nullptr)();
+}
+
+void HandoffListener::Close() {
+  loop_->Remove(fd_);
+  close(fd_);
+  fd_ = -1;
+}
+
+bool ReceiveHandoff(const std::string &path, std::vector<int> *fds,
+                    std::string *data) {
+  sockaddr_un sa{};
+  if (!ToUnixAddr(path, &sa)) {
+    return false;
+  }
+  int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (fd < 0) {
+    LOG_ERRNO();
+    return false;
+  }
+  if (connect(fd, reinterpret_cast<const sockaddr *>(&sa), sizeof(sa)) != 0) {
+    // Nobody to take over from: a cold start.
+    close(fd);
+    return false;
+  }
+  if (!PeerIsUs(fd)) {
+    close(fd);
+    return false;
+  }
+  SetTimeouts(fd);
+
+  uint8_t header[kHandoffHeaderSize];
+  iovec iov{header, sizeof(header)};
+  alignas(cmsghdr) char control[CMSG_SPACE(sizeof(int) * kMaxHandoffFds)]{};
+  msghdr msg{};
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control;
+  msg.msg_controllen = sizeof(control);
+  auto n = recvmsg(fd, &msg, MSG_CMSG_CLOEXEC | MSG_WAITALL);
+
+  std::vector<int> received{};
+  for (cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg != nullptr;
+       cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+    if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS) {
+      continue;
+    }
+    size_t count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+    size_t offset = received.size();
+    received.resize(offset + count);
+    memcpy(received.data() + offset, CMSG_DATA(cmsg), sizeof(int) * count);
+  }
+  bool ok = n == sizeof(header) && (msg.msg_flags & MSG_CTRUNC) == 0;
+  if (ok) {
+    data->resize(str::LoadBigEndian<uint64_t>(header));
+    ok = ReadAll(fd, data->data(), data->size()) &&
+         WriteAll(fd, &kHandoffAck, 1);
+  }
+  close(fd);
+  if (!ok) {
+    SPDLOG_ERROR("[Handoff] receive failed, path={}", path);
+    for (int received_fd : received) {
+      close(received_fd);
+    }
+    data->clear();
+    return false;
+  }
+  *fds = std::move(received);
+  return true;
+}
+
+std::string PrivateRuntimePath(const std::string &name) {
+  // Created by the session manager with mode 0700 (XDG Base Directory).
+  if (const char *runtime = getenv("XDG_RUNTIME_DIR");
+      runtime != nullptr && runtime[0] == '/') {
+    return std::string{runtime} + "/" + name;
+  }
+  std::string dir = "/tmp/boots-" + std::to_string(getuid());
+  if (mkdir(dir.c_str(), S_IRWXU) != 0 && errno != EEXIST) {
+    LOG_ERRNO();
+    return {};
+  }
+  // Anyone may have created it first, so it is trusted only if it is still
+  // a directory that we own and nobody else can enter.
+  struct stat st {};
+  if (lstat(dir.c_str(), &st) != 0 || !S_ISDIR(st.st_mode) ||
+      st.st_uid != getuid() || (st.st_mode & (S_IRWXG | S_IRWXO)) != 0) {
+    SPDLOG_ERROR("[Handoff] runtime dir not private, dir={}", dir);
+    return {};
+  }
+  return dir + "/" + name;
+}
+
+}  // namespace boots
@@ -0,0 +1,102 @@
+#include "boots/ip_address.h"
+
+#include <arpa/inet.h>
+
+#include <cstring>
+
+#include "net.h"
+
+namespace boots {
+
+static constexpr std::array<uint8_t, 12> kV4MappedPrefix{
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0xFF, 0xFF};
+
+// Only digits and dots can make an IPv4 literal, and only an IPv6 literal
+// has a colon, so nearly every hostname fails here on its first letter.
+static bool MaybeLiteral(std::string_view s, bool *v6) {
+  if (s.empty() || s.size() > IpAddress::kMaxTextSize) {
+    return false;
+  }
+  *v6 = s.find(':') != std::string_view::npos;
+  for (char c : s) {
+    bool digit = c >= '0' && c <= '9';
+    bool hex = (c >= 'a' && c <= 'f') || (c >= 'A' && c <= 'F');
+    if (!digit && c != '.' && !(*v6 && (hex || c == ':'))) {
+      return false;
+    }
+  }
+  return true;
+}
+
+IpAddress IpAddress::FromV4(const uint8_t *bytes) {
+  IpAddress ip{};
+  memcpy(ip.bytes_.data(), kV4MappedPrefix.data(), kV4MappedPrefix.size());
+  memcpy(ip.bytes_.data() + kV4MappedPrefix.size(), bytes, 4);
+  return ip;
+}
+
+IpAddress IpAddress::FromV6(const uint8_t *bytes) {
+  IpAddress ip{};
+  memcpy(ip.bytes_.data(), bytes, kSize);
+  return ip;
+}
+
+bool IpAddress::Parse(std::string_view s, IpAddress *ip) {
+  bool v6{};
+  if (!MaybeLiteral(s, &v6)) {
+    return false;
+  }
+  uint8_t bytes[kSize];
+  if (!net::Pton(v6 ? AF_INET6 : AF_INET, s, bytes)) {
+    return false;
+  }
+  *ip = v6 ? FromV6(bytes) : FromV4(bytes);
+  return true;
+}
+
+bool IpAddress::IsV4() const {
+  return memcmp(bytes_.data(), kV4MappedPrefix.data(),
+                kV4MappedPrefix.size()) == 0;
+}
+
+int IpAddress::Family() const {
+  if (Empty()) {
+    return AF_UNSPEC;
+  }
+  return IsV4() ? AF_INET : AF_INET6;
+}
+
+bool IpAddress::ToSockaddr(uint16_t port, sockaddr_storage *sa) const {
+  *sa = {};
+  if (Empty()) {
+    return false;
+  }
+  if (IsV4()) {
+    auto *sin = reinterpret_cast<sockaddr_in *>(sa);
+    sin->sin_family = AF_INET;
+    sin->sin_port = htons(port);
+    memcpy(&sin->sin_addr, bytes_.data() + kV4MappedPrefix.size(), 4);
+  } else {
+    auto *sin6 = reinterpret_cast<sockaddr_in6 *>(sa);
+    sin6->sin6_family = AF_INET6;
+    sin6->sin6_port = htons(port);
+    memcpy(&sin6->sin6_addr, bytes_.data(), kSize);
+  }
+  return true;
+}
+
+std::string IpAddress::ToString() const {
+  if (Empty()) {
+    return {};
+  }
+  char text[INET6_ADDRSTRLEN];
+  if (IsV4()) {
+    inet_ntop(AF_INET, bytes_.data() + kV4MappedPrefix.size(), text,
+              sizeof(text));
+  } else {
+    inet_ntop(AF_INET6, bytes_.data(), text, sizeof(text));
+  }
+  return text;
+}
+
+}  // namespace boots
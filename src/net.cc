@@ -1,13 +1,24 @@
 #include "net.h"
 
+#include <cstring>
+
 namespace boots::net {
+bool Pton(int family, std::string_view s, void *dst) {
+  char text[INET6_ADDRSTRLEN];
+  if (s.size() >= sizeof(text)) {
+    return false;
+  }
+  memcpy(text, s.data(), s.size());
+  text[s.size()] = '\0';
+  return 1 == inet_pton(family, text, dst);
+}
+
 bool ToIpv4(std::string_view s, sockaddr_storage *sa) {
   sockaddr_storage temp_sa{};
   if (sa == nullptr) {
     sa = &temp_sa;
   }
-  return 1 == inet_pton(AF_INET, s.data(),
-                        &reinterpret_cast<sockaddr_in *>(sa)->sin_addr);
+  return Pton(AF_INET, s, &reinterpret_cast<sockaddr_in *>(sa)->sin_addr);
 }
 
 bool ToIpv6(std::string_view s, sockaddr_storage *sa) {
@@ -15,13 +26,40 @@ bool ToIpv6(std::string_view s, sockaddr_storage *sa) {
   if (sa == nullptr) {
     sa = &temp_sa;
   }
-
-  return 1 == inet_pton(AF_INET6, s.data(),
-                        &reinterpret_cast<sockaddr_in6 *>(sa)->sin6_addr);
+  return Pton(AF_INET6, s, &reinterpret_cast<sockaddr_in6 *>(sa)->sin6_addr);
 }
 
 bool ToIp(std::string_view s, sockaddr_storage *sa) {
   return ToIpv4(s, sa) || ToIpv6(s, sa);
 }
 
+bool ToSockaddr(std::string_view s, uint16_t port, sockaddr_storage *sa) {
+  *sa = {};
+  if (ToIpv4(s, sa)) {
+    auto *sin = reinterpret_cast<sockaddr_in *>(sa);
+    sin->sin_family = AF_INET;
+    sin->sin_port = htons(port);
+    return true;
+  }
+  if (ToIpv6(s, sa)) {
+    auto *sin6 = reinterpret_cast<sockaddr_in6 *>(sa);
+    sin6->sin6_family = AF_INET6;
+    sin6->sin6_port = htons(port);
+    return true;
+  }
+  return false;
+}
+
+socklen_t SockaddrLen(const sockaddr_storage &sa) {
+  return sa.ss_family == AF_INET6 ? sizeof(sockaddr_in6) : sizeof(sockaddr_in);
+}
+
+void SetPort(sockaddr_storage *sa, uint16_t port) {
+  if (sa->ss_family == AF_INET6) {
+    reinterpret_cast<sockaddr_in6 *>(sa)->sin6_port = htons(port);
+  } else {
+    reinterpret_cast<sockaddr_in *>(sa)->sin_port = htons(port);
+  }
+}
+
 }  // namespace boots::net
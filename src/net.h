@@ -4,8 +4,15 @@
 #include <string_view>
 
 namespace boots::net {
+// inet_pton() for a `s` that need not be NUL-terminated. `dst` takes 4 or 16
+// bytes according to `family`.
+bool Pton(int family, std::string_view s, void *dst);
 bool ToIpv4(std::string_view s, sockaddr_storage *sa = nullptr);
 bool ToIpv6(std::string_view s, sockaddr_storage *sa = nullptr);
 bool ToIp(std::string_view s, sockaddr_storage *sa = nullptr);
+// Like ToIp, but also sets the address family and `port` (host order).
+bool ToSockaddr(std::string_view s, uint16_t port, sockaddr_storage *sa);
+socklen_t SockaddrLen(const sockaddr_storage &sa);
+void SetPort(sockaddr_storage *sa, uint16_t port);
 
 }  // namespace boots::net
@@ -0,0 +1,281 @@
+#include "proxy_handshake.h"
+
+#include <arpa/inet.h>
+
+#include <array>
+#include <charconv>
+#include <cstring>
+
+namespace boots {
+
+static constexpr uint8_t kSocksVersion = 5;
+static constexpr uint8_t kSocksNoAuthMethod = 0;
+static constexpr uint8_t kSocksConnect = 1;
+static constexpr uint8_t kSocksIpv4 = 1;
+static constexpr uint8_t kSocksDomain = 3;
+static constexpr uint8_t kSocksIpv6 = 4;
+
+static constexpr std::string_view kHttpConnect = "CONNECT ";
+// Request line and headers together; nothing of them is kept.
+static constexpr size_t kMaxHttpRequest = 8192;
+
+// VER REP RSV ATYP=IPv4 BND.ADDR=0 BND.PORT=0; the bound address is of no
+// use to a CONNECT client.
+static constexpr std::array<char, 10> SocksReply(uint8_t code) {
+  return {kSocksVersion, static_cast<char>(code), 0, kSocksIpv4, 0, 0, 0, 0,
+          0, 0};
+}
+
+static constexpr std::array<char, 2> kSocksNoAuth{kSocksVersion,
+                                                  kSocksNoAuthMethod};
+static constexpr std::array<char, 2> kSocksNoAcceptableMethod{
+    kSocksVersion, static_cast<char>(0xff)};
+static constexpr auto kSocksSucceeded = SocksReply(0x00);
+static constexpr auto kSocksGeneralFailure = SocksReply(0x01);
+static constexpr auto kSocksHostUnreachable = SocksReply(0x04);
+static constexpr auto kSocksConnectionRefused = SocksReply(0x05);
+static constexpr auto kSocksCommandNotSupported = SocksReply(0x07);
+static constexpr auto kSocksAddressNotSupported = SocksReply(0x08);
+
+static constexpr std::string_view kHttpEstablished =
+    "HTTP/1.1 200 Connection Established\r\n\r\n";
+static constexpr std::string_view kHttpBadRequest =
+    "HTTP/1.1 400 Bad Request\r\nConnection: close\r\n\r\n";
+static constexpr std::string_view kHttpMethodNotAllowed =
+    "HTTP/1.1 405 Method Not Allowed\r\nAllow: CONNECT\r\n"
+    "Connection: close\r\n\r\n";
+static constexpr std::string_view kHttpTooLarge =
+    "HTTP/1.1 431 Request Header Fields Too Large\r\n"
+    "Connection: close\r\n\r\n";
+static constexpr std::string_view kHttpBadGateway =
+    "HTTP/1.1 502 Bad Gateway\r\nConnection: close\r\n\r\n";
+
+template <size_t N>
+static constexpr std::string_view View(const std::array<char, N> &reply) {
+  return {reply.data(), reply.size()};
+}
+
+ProxyHandshake::ProxyHandshake(Protocol protocol)
+    : protocol_{protocol},
+      state_{protocol == Protocol::kSocks5 ? State::kSocksVersion
+                                           : State::kHttpMethod} {}
+
+ProxyHandshake::Event ProxyHandshake::Feed(const uint8_t *data, size_t len,
+                                           size_t *consumed) {
+  *consumed = 0;
+  if (state_ == State::kDone) {
+    return Event::kDone;
+  }
+  if (state_ == State::kError) {
+    return Event::kError;
+  }
+  return protocol_ == Protocol::kSocks5 ? FeedSocks(data, len, consumed)
+                                        : FeedHttp(data, len, consumed);
+}
+
+std::string_view ProxyHandshake::Success() const {
+  return protocol_ == Protocol::kSocks5 ? View(kSocksSucceeded)
+                                        : kHttpEstablished;
+}
+
+std::string_view ProxyHandshake::Refusal(Failure failure) const {
+  if (protocol_ == Protocol::kHttpConnect) {
+    return kHttpBadGateway;
+  }
+  switch (failure) {
+    case Failure::kHostUnreachable:
+      return View(kSocksHostUnreachable);
+    case Failure::kRefused:
+      return View(kSocksConnectionRefused);
+    default:
+      return View(kSocksGeneralFailure);
+  }
+}
+
+ProxyHandshake::Event ProxyHandshake::FeedSocks(const uint8_t *data,
+                                                size_t len, size_t *consumed) {
+  size_t i = 0;
+  while (i < len) {
+    uint8_t c = data[i++];
+    *consumed = i;
+    switch (state_) {
+      case State::kSocksVersion:
+        if (c != kSocksVersion) {
+          return Fail({});
+        }
+        state_ = State::kSocksMethodCount;
+        break;
+      case State::kSocksMethodCount:
+        if (c == 0) {
+          return Fail(View(kSocksNoAcceptableMethod));
+        }
+        remaining_ = c;
+        state_ = State::kSocksMethods;
+        break;
+      case State::kSocksMethods:
+        no_auth_offered_ |= c == kSocksNoAuthMethod;
+        if (--remaining_ > 0) {
+          break;
+        }
+        if (!no_auth_offered_) {
+          return Fail(View(kSocksNoAcceptableMethod));
+        }
+        state_ = State::kSocksRequestVersion;
+        reply_ = View(kSocksNoAuth);
+        return Event::kReply;
+      case State::kSocksRequestVersion:
+        if (c != kSocksVersion) {
+          return Fail(View(kSocksGeneralFailure));
+        }
+        state_ = State::kSocksCommand;
+        break;
+      case State::kSocksCommand:
+        if (c != kSocksConnect) {
+          return Fail(View(kSocksCommandNotSupported));
+        }
+        state_ = State::kSocksReserved;
+        break;
+      case State::kSocksReserved:
+        state_ = State::kSocksAddressType;
+        break;
+      case State::kSocksAddressType:
+        address_type_ = c;
+        if (c == kSocksIpv4) {
+          remaining_ = 4;
+          state_ = State::kSocksAddress;
+        } else if (c == kSocksIpv6) {
+          remaining_ = 16;
+          state_ = State::kSocksAddress;
+        } else if (c == kSocksDomain) {
+          state_ = State::kSocksHostLength;
+        } else {
+          return Fail(View(kSocksAddressNotSupported));
+        }
+        break;
+      case State::kSocksHostLength:
+        if (c == 0) {
+          return Fail(View(kSocksGeneralFailure));
+        }
+        remaining_ = c;
+        state_ = State::kSocksAddress;
+        break;
+      case State::kSocksAddress:
+        if (address_type_ == kSocksDomain) {
+          host_[host_len_++] = static_cast<char>(c);
+        } else {
+          size_t size = address_type_ == kSocksIpv4 ? 4 : 16;
+          address_[size - remaining_] = c;
+        }
+        if (--remaining_ > 0) {
+          break;
+        }
+        if (address_type_ != kSocksDomain) {
+          inet_ntop(address_type_ == kSocksIpv4 ? AF_INET : AF_INET6,
+                    address_, host_, sizeof(host_));
+          host_len_ = strlen(host_);
+        }
+        remaining_ = 2;
+        state_ = State::kSocksPort;
+        return Event::kHost;
+      case State::kSocksPort:
+        port_ = static_cast<uint16_t>(port_ << 8 | c);
+        if (--remaining_ == 0) {
+          state_ = State::kDone;
+          return Event::kDone;
+        }
+        break;
+      default:
+        return Fail({});
+    }
+  }
+  return Event::kNeedMore;
+}
+
+ProxyHandshake::Event ProxyHandshake::FeedHttp(const uint8_t *data, size_t len,
+                                               size_t *consumed) {
+  size_t i = 0;
+  while (i < len) {
+    auto c = static_cast<char>(data[i++]);
+    *consumed = i;
+    if (++total_len_ > kMaxHttpRequest) {
+      return Fail(kHttpTooLarge);
+    }
+    switch (state_) {
+      case State::kHttpMethod:
+        if (c != kHttpConnect[line_len_]) {
+          return Fail(kHttpMethodNotAllowed);
+        }
+        if (++line_len_ == kHttpConnect.size()) {
+          state_ = State::kHttpAuthority;
+        }
+        break;
+      case State::kHttpAuthority:
+        if (c == ' ') {
+          if (!SplitAuthority()) {
+            return Fail(kHttpBadRequest);
+          }
+          state_ = State::kHttpVersion;
+          return Event::kHost;
+        }
+        if (c == '\r' || c == '\n' || host_len_ + 1 == sizeof(host_)) {
+          return Fail(kHttpBadRequest);
+        }
+        host_[host_len_++] = c;
+        break;
+      case State::kHttpVersion:
+        if (c == '\n') {
+          line_len_ = 0;
+          state_ = State::kHttpHeaders;
+        }
+        break;
+      case State::kHttpHeaders:
+        // Headers are skipped; an empty line ends them.
+        if (c == '\n') {
+          if (line_len_ == 0) {
+            state_ = State::kDone;
+            return Event::kDone;
+          }
+          line_len_ = 0;
+        } else if (c != '\r') {
+          ++line_len_;
+        }
+        break;
+      default:
+        return Fail({});
+    }
+  }
+  return Event::kNeedMore;
+}
+
+ProxyHandshake::Event ProxyHandshake::Fail(std::string_view reply) {
+  state_ = State::kError;
+  reply_ = reply;
+  return Event::kError;
+}
+
+bool ProxyHandshake::SplitAuthority() {
+  std::string_view authority{host_, host_len_};
+  auto colon = authority.rfind(':');
+  if (colon == std::string_view::npos) {
+    return false;
+  }
+  auto port = authority.substr(colon + 1);
+  const char *end = port.data() + port.size();
+  auto [ptr, ec] = std::from_chars(port.data(), end, port_);
+  if (ec != std::errc{} || ptr != end || port_ == 0) {
+    return false;
+  }
+  auto host = authority.substr(0, colon);
+  if (host.size() >= 2 && host.front() == '[' && host.back() == ']') {
+    host = host.substr(1, host.size() - 2);
+  }
+  if (host.empty() || host.size() > kMaxHost) {
+    return false;
+  }
+  memmove(host_, host.data(), host.size());
+  host_len_ = host.size();
+  host_[host_len_] = '\0';
+  return true;
+}
+
+}  // namespace boots
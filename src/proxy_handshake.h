@@ -0,0 +1,96 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string_view>
+
+namespace boots {
+
+// Incremental parser for the client side of a proxy handshake: SOCKS5
+// (RFC 1928, no authentication, CONNECT only) or HTTP CONNECT. All state
+// lives in the object itself, so a handshake split across any number of
+// reads costs no allocation.
+//
+// Feed() stops at each event so the caller can act on it before the rest of
+// the request arrives; in particular kHost is reported as soon as the target
+// host is complete, ahead of the SOCKS5 port and the HTTP headers.
+class ProxyHandshake {
+ public:
+  enum class Protocol : uint8_t { kSocks5, kHttpConnect };
+  enum class Event : uint8_t {
+    // All input was consumed without completing the handshake.
+    kNeedMore,
+    // Reply() must be sent to the client before going on.
+    kReply,
+    // Host() is known; Port() may not be yet.
+    kHost,
+    // The request is complete. Bytes after it belong to the tunnel.
+    kDone,
+    // Malformed or unsupported request; Reply() may hold a refusal to send
+    // before closing.
+    kError,
+  };
+  enum class Failure : uint8_t { kGeneral, kHostUnreachable, kRefused };
+
+  explicit ProxyHandshake(Protocol protocol = Protocol::kSocks5);
+
+  // Parses `data` up to the next event and stores in `consumed` how many
+  // bytes were used. Nothing past the end of the request is ever consumed.
+  Event Feed(const uint8_t *data, size_t len, size_t *consumed);
+
+  [[nodiscard]] bool Done() const { return state_ == State::kDone; }
+  [[nodiscard]] std::string_view Host() const { return {host_, host_len_}; }
+  [[nodiscard]] uint16_t Port() const { return port_; }
+  [[nodiscard]] std::string_view Reply() const { return reply_; }
+
+  // Final replies, once the upstream connect has succeeded or failed.
+  [[nodiscard]] std::string_view Success() const;
+  [[nodiscard]] std::string_view Refusal(Failure failure) const;
+
+ private:
+  enum class State : uint8_t {
+    kSocksVersion,
+    kSocksMethodCount,
+    kSocksMethods,
+    kSocksRequestVersion,
+    kSocksCommand,
+    kSocksReserved,
+    kSocksAddressType,
+    kSocksHostLength,
+    kSocksAddress,
+    kSocksPort,
+    kHttpMethod,
+    kHttpAuthority,
+    kHttpVersion,
+    kHttpHeaders,
+    kDone,
+    kError,
+  };
+  // Longest DNS name; also fits any textual IP address.
+  static constexpr size_t kMaxHost = 255;
+
+  Event FeedSocks(const uint8_t *data, size_t len, size_t *consumed);
+  Event FeedHttp(const uint8_t *data, size_t len, size_t *consumed);
+  Event Fail(std::string_view reply);
+  // Splits "host:port" or "[v6]:port" collected in `host_`.
+  bool SplitAuthority();
+
+  Protocol protocol_;
+  State state_;
+  // Bytes still expected in the current field.
+  uint16_t remaining_{};
+  uint16_t port_{};
+  bool no_auth_offered_{};
+  uint8_t address_type_{};
+  // Raw SOCKS5 address bytes until they are formatted into `host_`.
+  uint8_t address_[16]{};
+  // Length of the current HTTP line and of all HTTP input so far.
+  uint16_t line_len_{};
+  uint16_t total_len_{};
+  size_t host_len_{};
+  // Leaves room for the ":port" of an HTTP authority.
+  char host_[kMaxHost + 8]{};
+  std::string_view reply_{};
+};
+
+}  // namespace boots
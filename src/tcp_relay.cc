@@ -1,13 +1,68 @@
-#include "tcp_relay.h"
+#include "boots/tcp_relay.h"
 
+#include <fcntl.h>
+#include <netinet/tcp.h>
+#include <unistd.h>
+
+#include "boots/dns_resolver.h"
 #include "boots/event_loop.h"
+#include "buffer_chain.h"
 #include "log.h"
 #include "net.h"
+#include "proxy_handshake.h"
 #include "util.h"
 
 namespace boots {
 
-TcpRelay::TcpRelay(EventLoop *loop, uint16_t port) : loop_{loop} {
+static constexpr size_t kSpliceChunk = 64 * 1024;
+// Handshake bytes peeked per read; a SOCKS5 request always fits.
+static constexpr size_t kHandshakePeek = 512;
+
+struct TcpRelay::Session {
+  int client{-1};
+  int upstream{-1};
+  sockaddr_storage upstream_addr{};
+  // dirs[0] carries client -> upstream, dirs[1] upstream -> client.
+  struct Direction {
+    // Used by the splice() path.
+    int pipe[2]{-1, -1};
+    size_t buffered{};
+    // Used by the user-space path; holds no chunks while nothing is queued.
+    BufferChain buf;
+    bool paused{};
+    bool eof{};
+    bool shut{};
+
+    Direction(ChunkPool *pool, size_t headroom) : buf{pool, headroom} {}
+  } dirs[2];
+  uint32_t interest[2]{};
+  ProxyHandshake handshake;
+  // The target address is known, without its port until the handshake ends.
+  bool resolved{};
+  // An upstream that never carried data can go back to the pool.
+  bool forwarded{};
+  bool closed{};
+
+  Session(ChunkPool *pool, size_t headroom, ProxyHandshake::Protocol protocol)
+      : dirs{Direction{pool, headroom}, Direction{pool, headroom}},
+        handshake{protocol} {}
+
+  int Source(int dir) const { return dir == 0 ? client : upstream; }
+  int Sink(int dir) const { return dir == 0 ? upstream : client; }
+};
+
+TcpRelay::TcpRelay(EventLoop *loop, std::shared_ptr<DnsResolver> resolver,
+                   uint16_t port, const TcpRelayOptions &options)
+    : loop_{loop},
+      resolver_{std::move(resolver)},
+      options_{options},
+      pool_{std::make_shared<UpstreamPool>(loop, options.pool)},
+      chunk_pool_{std::make_unique<ChunkPool>()} {
+  if (options.listen_fd >= 0) {
+    fd_ = options.listen_fd;
+    loop_->TuneSocket(fd_);
+    return;
+  }
   fd_ =
       socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, IPPROTO_TCP);
   LOG_ERRNO_IF(fd_ < 0);
@@ -16,11 +71,424 @@ TcpRelay::TcpRelay(EventLoop *loop, uint16_t port) : loop_{loop} {
   LOG_ERRNO_IF(n < 0);
   n = setsockopt(fd_, SOL_SOCKET, SO_REUSEPORT, &val, sizeof(val));
   LOG_ERRNO_IF(n < 0);
-  sockaddr_in sa{AF_INET, port, str::Swap(INADDR_ANY)};
+  sockaddr_in sa{AF_INET, str::Swap(port), {str::Swap(INADDR_ANY)}};
   n = bind(fd_, reinterpret_cast<const sockaddr *>(&sa), sizeof(sa));
   LOG_ERRNO_IF(n < 0);
 
   n = listen(fd_, SOMAXCONN);
   LOG_ERRNO_IF(n < 0);
+  loop_->TuneSocket(fd_);
+}
+
+TcpRelay::~TcpRelay() {
+  while (!sessions_.empty()) {
+    Close(sessions_.begin()->second.get());
+  }
+  if (fd_ >= 0) {
+    close(fd_);
+  }
+}
+
+void TcpRelay::Init() {
+  pool_->Init();
+  loop_->Add(fd_, EventLoop::kPollIn,
+             [r = shared_from_this()](int, uint32_t) { r->Accept(); });
+  if (options_.mode != TcpRelayOptions::Mode::kForward ||
+      options_.prewarm_connections == 0) {
+    return;
+  }
+  ResolveTarget(options_.target_host, options_.target_port,
+                [w = weak_from_this()](const sockaddr_storage *addr,
+                                       const std::string &) {
+    auto r = w.lock();
+    if (r == nullptr || addr == nullptr) {
+      return;
+    }
+    r->pool_->Prewarm(*addr, r->options_.prewarm_connections);
+  });
+}
+
+void TcpRelay::Shutdown(std::function<void()> drained) {
+  if (fd_ >= 0) {
+    loop_->Remove(fd_);
+    close(fd_);
+    fd_ = -1;
+  }
+  spdlog::info("[TcpRelay.Shutdown] draining, sessions={}", sessions_.size());
+  if (sessions_.empty()) {
+    drained();
+    return;
+  }
+  drained_ = std::move(drained);
+}
+
+void TcpRelay::Accept() {
+  for (;;) {
+    int fd = accept4(fd_, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if (fd < 0) {
+      if (errno != EAGAIN && errno != EWOULDBLOCK) {
+        LOG_ERRNO();
+      }
+      return;
+    }
+    int val{1};
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &val, sizeof(val));
+    loop_->TuneSocket(fd);
+
+    bool forward = options_.mode == TcpRelayOptions::Mode::kForward;
+    auto session = std::make_shared<Session>(
+        chunk_pool_.get(), options_.buffer_headroom,
+        options_.mode == TcpRelayOptions::Mode::kSocks5
+            ? ProxyHandshake::Protocol::kSocks5
+            : ProxyHandshake::Protocol::kHttpConnect);
+    session->client = fd;
+    sessions_.insert({fd, session});
+    // Apart from the handshake nothing is read until the upstream is ready;
+    // errors and resets are still reported.
+    session->interest[0] = forward ? 0 : EventLoop::kPollIn;
+    loop_->Add(fd, session->interest[0],
+               [this, s = session.get()](int fd, uint32_t events) {
+                 OnEvent(s, fd, events);
+               });
+    if (forward) {
+      Resolve(session, options_.target_host, options_.target_port);
+    }
+  }
+}
+
+void TcpRelay::Handshake(Session *session) {
+  // Keeps the session alive across callbacks that may close it.
+  auto hold = sessions_.at(session->client);
+  auto &handshake = session->handshake;
+  uint8_t buf[kHandshakePeek];
+  while (!handshake.Done()) {
+    // Peeking leaves whatever follows the handshake in the socket, to be
+    // relayed like any later data.
+    auto n = recv(session->client, buf, sizeof(buf), MSG_PEEK);
+    if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+      return;
+    }
+    if (n <= 0) {
+      LOG_ERRNO_L(DEBUG, "fd={}", session->client);
+      Close(session);
+      return;
+    }
+    size_t offset = 0;
+    bool more = true;
+    while (more && !handshake.Done()) {
+      size_t consumed{};
+      auto event = handshake.Feed(buf + offset, n - offset, &consumed);
+      offset += consumed;
+      switch (event) {
+        case ProxyHandshake::Event::kNeedMore:
+          more = false;
+          break;
+        case ProxyHandshake::Event::kReply:
+          if (!SendReply(session, handshake.Reply())) {
+            Close(session);
+            return;
+          }
+          break;
+        case ProxyHandshake::Event::kHost:
+          // Resolving overlaps with the rest of the request.
+          Resolve(hold, std::string{handshake.Host()}, handshake.Port());
+          if (session->closed) {
+            return;
+          }
+          break;
+        case ProxyHandshake::Event::kDone:
+          break;
+        case ProxyHandshake::Event::kError:
+          spdlog::debug("[TcpRelay.Handshake] bad request, fd={}",
+                        session->client);
+          Fail(session, handshake.Reply());
+          return;
+      }
+    }
+    recv(session->client, buf, offset, 0);
+  }
+  session->interest[0] = 0;
+  loop_->Modify(session->client, 0);
+  if (session->resolved) {
+    Connect(hold);
+  }
+}
+
+bool TcpRelay::SendReply(Session *session, std::string_view reply) {
+  if (reply.empty()) {
+    return true;
+  }
+  // Replies are a few dozen bytes on a socket that has sent nothing else, so
+  // a short write means the client is gone.
+  auto n = send(session->client, reply.data(), reply.size(), MSG_NOSIGNAL);
+  if (n != static_cast<ssize_t>(reply.size())) {
+    LOG_ERRNO_L(DEBUG, "fd={}", session->client);
+    return false;
+  }
+  return true;
+}
+
+void TcpRelay::Resolve(const std::shared_ptr<Session> &session,
+                       const std::string &host, uint16_t port) {
+  ResolveTarget(host, port, [w = weak_from_this(), session](
+                                const sockaddr_storage *addr,
+                                const std::string &error) {
+    auto r = w.lock();
+    if (r == nullptr || session->closed) {
+      return;
+    }
+    if (addr == nullptr) {
+      SPDLOG_ERROR("[TcpRelay] resolve target failed, error={}", error);
+      r->Fail(session.get(),
+              session->handshake.Refusal(
+                  ProxyHandshake::Failure::kHostUnreachable));
+      return;
+    }
+    session->upstream_addr = *addr;
+    session->resolved = true;
+    if (r->options_.mode == TcpRelayOptions::Mode::kForward ||
+        session->handshake.Done()) {
+      r->Connect(session);
+    }
+  });
 }
+
+void TcpRelay::Connect(const std::shared_ptr<Session> &session) {
+  if (options_.mode != TcpRelayOptions::Mode::kForward) {
+    net::SetPort(&session->upstream_addr, session->handshake.Port());
+  }
+  pool_->Acquire(
+      session->upstream_addr,
+      [w = weak_from_this(), session](int fd, const std::string &error) {
+        auto r = w.lock();
+        if (fd >= 0 && (r == nullptr || session->closed)) {
+          if (r != nullptr) {
+            r->pool_->Release(session->upstream_addr, fd);
+          } else {
+            close(fd);
+          }
+          return;
+        }
+        if (r == nullptr) {
+          return;
+        }
+        if (fd < 0) {
+          SPDLOG_ERROR("[TcpRelay] connect upstream failed, error={}", error);
+          r->Fail(session.get(), session->handshake.Refusal(
+                                     ProxyHandshake::Failure::kRefused));
+          return;
+        }
+        if (r->options_.mode != TcpRelayOptions::Mode::kForward &&
+            !r->SendReply(session.get(), session->handshake.Success())) {
+          r->pool_->Release(session->upstream_addr, fd);
+          r->Close(session.get());
+          return;
+        }
+        r->Start(session, fd);
+      });
+}
+
+void TcpRelay::Start(const std::shared_ptr<Session> &session, int upstream) {
+  session->upstream = upstream;
+  loop_->TuneSocket(upstream);
+  for (auto &dir : session->dirs) {
+    if (options_.use_splice && pipe2(dir.pipe, O_NONBLOCK | O_CLOEXEC) != 0) {
+      LOG_ERRNO();
+      Close(session.get());
+      return;
+    }
+  }
+  loop_->Add(upstream, 0, [this, s = session.get()](int fd, uint32_t events) {
+    OnEvent(s, fd, events);
+  });
+  UpdateInterest(session.get());
+}
+
+void TcpRelay::OnEvent(Session *session, int fd, uint32_t events) {
+  if (session->upstream < 0) {
+    if (options_.mode != TcpRelayOptions::Mode::kForward &&
+        !session->handshake.Done() && (events & EventLoop::kPollIn)) {
+      Handshake(session);
+      return;
+    }
+    // Otherwise only errors are reported before the upstream is ready.
+    Close(session);
+    return;
+  }
+  // `dir` is the direction reading from `fd`; the other one writes to it.
+  int dir = fd == session->client ? 0 : 1;
+  if ((events & EventLoop::kPollOut) && !Drain(session, 1 - dir)) {
+    return;
+  }
+  if ((events & (EventLoop::kPollIn | EventLoop::kPollHup |
+                 EventLoop::kPollErr)) &&
+      !Transfer(session, dir)) {
+    return;
+  }
+  if (session->dirs[0].shut && session->dirs[1].shut) {
+    Close(session);
+    return;
+  }
+  UpdateInterest(session);
+}
+
+bool TcpRelay::Transfer(Session *session, int dir) {
+  auto &d = session->dirs[dir];
+  while (!d.eof && (options_.use_splice
+                        ? d.buffered == 0
+                        : d.buf.Size() < options_.high_watermark)) {
+    ssize_t n{};
+    if (options_.use_splice) {
+      n = splice(session->Source(dir), nullptr, d.pipe[1], nullptr,
+                 kSpliceChunk, SPLICE_F_NONBLOCK | SPLICE_F_MOVE);
+    } else {
+      n = d.buf.ReadFrom(session->Source(dir),
+                         options_.high_watermark - d.buf.Size());
+    }
+    if (n < 0) {
+      if (errno == EAGAIN || errno == EWOULDBLOCK) {
+        break;
+      }
+      LOG_ERRNO_L(DEBUG, "fd={}", session->Source(dir));
+      Close(session);
+      return false;
+    }
+    if (n == 0) {
+      d.eof = true;
+      break;
+    }
+    if (options_.use_splice) {
+      d.buffered += n;
+    }
+    session->forwarded = true;
+    if (!Drain(session, dir)) {
+      return false;
+    }
+  }
+  return Drain(session, dir);
+}
+
+bool TcpRelay::Drain(Session *session, int dir) {
+  auto &d = session->dirs[dir];
+  while (Buffered(session, dir) > 0) {
+    ssize_t n{};
+    if (options_.use_splice) {
+      n = splice(d.pipe[0], nullptr, session->Sink(dir), nullptr, d.buffered,
+                 SPLICE_F_NONBLOCK | SPLICE_F_MOVE);
+    } else {
+      n = d.buf.WriteTo(session->Sink(dir));
+    }
+    if (n < 0) {
+      if (errno == EAGAIN || errno == EWOULDBLOCK) {
+        return true;
+      }
+      LOG_ERRNO_L(DEBUG, "fd={}", session->Sink(dir));
+      Close(session);
+      return false;
+    }
+    if (options_.use_splice) {
+      d.buffered -= n;
+    }
+  }
+  if (d.eof && !d.shut) {
+    shutdown(session->Sink(dir), SHUT_WR);
+    d.shut = true;
+  }
+  return true;
+}
+
+void TcpRelay::UpdateInterest(Session *session) {
+  for (int side = 0; side < 2; ++side) {
+    auto &reading = session->dirs[side];
+    // A slow sink pushes back on its source instead of growing a buffer:
+    // splice() reads only into an empty pipe, and the user-space path pauses
+    // between the high and low watermarks.
+    if (options_.use_splice) {
+      reading.paused = reading.buffered > 0;
+    } else if (reading.paused) {
+      reading.paused = reading.buf.Size() > options_.low_watermark;
+    } else {
+      reading.paused = reading.buf.Size() >= options_.high_watermark;
+    }
+    uint32_t events = 0;
+    if (!reading.eof && !reading.paused) {
+      events |= EventLoop::kPollIn;
+    }
+    if (Buffered(session, 1 - side) > 0) {
+      events |= EventLoop::kPollOut;
+    }
+    if (events != session->interest[side]) {
+      session->interest[side] = events;
+      loop_->Modify(side == 0 ? session->client : session->upstream, events);
+    }
+  }
+}
+
+size_t TcpRelay::Buffered(const Session *session, int dir) const {
+  const auto &d = session->dirs[dir];
+  return options_.use_splice ? d.buffered : d.buf.Size();
+}
+
+void TcpRelay::Fail(Session *session, std::string_view refusal) {
+  if (session->closed) {
+    return;
+  }
+  if (options_.mode != TcpRelayOptions::Mode::kForward &&
+      SendReply(session, refusal)) {
+    // Closing with unread input resets the connection, which can discard the
+    // reply before the client reads it.
+    uint8_t buf[kHandshakePeek];
+    while (recv(session->client, buf, sizeof(buf), MSG_DONTWAIT) > 0) {
+    }
+  }
+  Close(session);
+}
+
+void TcpRelay::Close(Session *session) {
+  if (session->closed) {
+    return;
+  }
+  session->closed = true;
+  loop_->Remove(session->client);
+  close(session->client);
+  if (session->upstream >= 0) {
+    loop_->Remove(session->upstream);
+    if (session->forwarded) {
+      close(session->upstream);
+    } else {
+      pool_->Release(session->upstream_addr, session->upstream);
+    }
+  }
+  for (auto &dir : session->dirs) {
+    for (int fd : dir.pipe) {
+      if (fd >= 0) {
+        close(fd);
+      }
+    }
+    dir.buf.Clear();
+  }
+  sessions_.erase(session->client);
+  if (drained_ != nullptr && sessions_.empty()) {
+    std::exchange(drained_, nullptr)();
+  }
+}
+
+void TcpRelay::ResolveTarget(
+    const std::string &host, uint16_t port,
+    std::function<void(const sockaddr_storage *addr, const std::string &error)>
+        callback) {
+  resolver_->Resolve(
+      host,
+      [port, callback = std::move(callback)](
+          const std::string &, const IpAddress &ip,
+          const std::string &error) {
+        sockaddr_storage addr{};
+        if (!error.empty() || !ip.ToSockaddr(port, &addr)) {
+          callback(nullptr, error.empty() ? "no address" : error);
+          return;
+        }
+        callback(&addr, {});
+      });
+}
+
 }  // namespace boots
@@ -0,0 +1,233 @@
+#include "boots/upstream_pool.h"
+
+#include <netinet/tcp.h>
+#include <unistd.h>
+
+#include <algorithm>
+
+#include "boots/event_loop.h"
+#include "log.h"
+#include "net.h"
+
+namespace boots {
+
+UpstreamPool::UpstreamPool(EventLoop *loop, const UpstreamPoolOptions &options)
+    : loop_{loop}, options_{options} {}
+
+UpstreamPool::~UpstreamPool() {
+  for (const auto &[fd, key] : idle_keys_) {
+    loop_->Remove(fd);
+    close(fd);
+  }
+  // Their handlers and timeouts see the pool gone and never finish them.
+  for (int fd : connecting_fds_) {
+    loop_->Remove(fd);
+    close(fd);
+  }
+}
+
+void UpstreamPool::Init() {
+  loop_->RunAfter(std::max<Clock::duration>(options_.idle_timeout / 4,
+                                            std::chrono::seconds{1}),
+                  [w = weak_from_this()] {
+                    if (auto pool = w.lock()) {
+                      pool->Sweep();
+                      pool->Init();
+                    }
+                  });
+}
+
+void UpstreamPool::Acquire(const sockaddr_storage &addr,
+                           ConnectFunc callback) {
+  Target *target = GetTarget(addr);
+  while (!target->idle.empty()) {
+    int fd = target->idle.back().fd;
+    target->idle.pop_back();
+    idle_keys_.erase(fd);
+    --idle_total_;
+    loop_->Remove(fd);
+    if (!IsAlive(fd)) {
+      close(fd);
+      continue;
+    }
+    if (target->prewarm != 0) {
+      Prewarm(addr, target->prewarm);
+    }
+    callback(fd, {});
+    return;
+  }
+  Connect(target, std::move(callback));
+}
+
+void UpstreamPool::Release(const sockaddr_storage &addr, int fd) {
+  if (!IsAlive(fd)) {
+    close(fd);
+    return;
+  }
+  Park(GetTarget(addr), fd);
+}
+
+void UpstreamPool::Prewarm(const sockaddr_storage &addr, size_t count) {
+  Target *target = GetTarget(addr);
+  target->prewarm = std::max(target->prewarm, count);
+  for (size_t n = target->idle.size() + target->connecting; n < count; ++n) {
+    Connect(target, [w = weak_from_this(), target](int fd, const auto &) {
+      auto pool = w.lock();
+      if (fd < 0) {
+        return;
+      }
+      if (pool == nullptr) {
+        close(fd);
+        return;
+      }
+      pool->Park(target, fd);
+    });
+  }
+}
+
+void UpstreamPool::Connect(Target *target, ConnectFunc callback) {
+  const sockaddr_storage &addr = target->addr;
+  int fd = socket(addr.ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC,
+                  IPPROTO_TCP);
+  if (fd < 0) {
+    LOG_ERRNO();
+    callback(-1, std::strerror(errno));
+    return;
+  }
+  int val{1};
+  setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &val, sizeof(val));
+  auto n = connect(fd, reinterpret_cast<const sockaddr *>(&addr),
+                   net::SockaddrLen(addr));
+  if (n == 0) {
+    callback(fd, {});
+    return;
+  }
+  if (errno != EINPROGRESS) {
+    std::string error{std::strerror(errno)};
+    close(fd);
+    callback(-1, error);
+    return;
+  }
+
+  // Shared by the writability handler and the timeout; whichever fires
+  // first completes the connect.
+  struct Pending {
+    int fd;
+    bool done{};
+    ConnectFunc callback;
+  };
+  auto pending = std::make_shared<Pending>(fd, false, std::move(callback));
+  ++target->connecting;
+  connecting_fds_.insert(fd);
+  auto finish = [this, target, pending](const std::string &error) {
+    pending->done = true;
+    --target->connecting;
+    connecting_fds_.erase(pending->fd);
+    loop_->Remove(pending->fd);
+    if (!error.empty()) {
+      close(pending->fd);
+      pending->callback(-1, error);
+      return;
+    }
+    pending->callback(pending->fd, {});
+  };
+  loop_->Add(fd, EventLoop::kPollOut | EventLoop::kPollHup,
+             [w = weak_from_this(), pending, finish](int fd, uint32_t) {
+               if (w.expired() || pending->done) {
+                 return;
+               }
+               int err{};
+               socklen_t len = sizeof(err);
+               getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &len);
+               finish(err != 0 ? std::strerror(err) : std::string{});
+             });
+  loop_->RunAfter(options_.connect_timeout,
+                  [w = weak_from_this(), pending, finish] {
+                    if (!w.expired() && !pending->done) {
+                      finish("connect timeout");
+                    }
+                  });
+}
+
+void UpstreamPool::Park(Target *target, int fd) {
+  if (idle_total_ >= options_.max_idle_total ||
+      target->idle.size() >= options_.max_idle_per_target) {
+    close(fd);
+    return;
+  }
+  target->idle.push_back({fd, Clock::now()});
+  idle_keys_.insert({fd, Key(target->addr)});
+  ++idle_total_;
+  // Anything arriving on an idle connection, FIN included, makes it unusable.
+  loop_->Add(fd, EventLoop::kPollIn | EventLoop::kPollHup,
+             [this](int fd, uint32_t) { Evict(fd); });
+}
+
+void UpstreamPool::Evict(int fd) {
+  auto it = idle_keys_.find(fd);
+  if (it == idle_keys_.end()) {
+    return;
+  }
+  auto &idle = targets_[it->second].idle;
+  std::erase_if(idle, [fd](const Idle &i) { return i.fd == fd; });
+  idle_keys_.erase(it);
+  --idle_total_;
+  loop_->Remove(fd);
+  close(fd);
+}
+
+void UpstreamPool::Sweep() {
+  auto deadline = Clock::now() - options_.idle_timeout;
+  std::vector<int> expired{};
+  for (auto &[key, target] : targets_) {
+    // The newest `prewarm` stay however old: closing them would only have
+    // Prewarm() open them again. Dead ones are evicted as they die.
+    size_t expirable =
+        target.idle.size() - std::min(target.idle.size(), target.prewarm);
+    for (size_t i = 0; i < expirable; ++i) {
+      if (target.idle[i].since > deadline) {
+        break;
+      }
+      expired.push_back(target.idle[i].fd);
+    }
+  }
+  for (int fd : expired) {
+    Evict(fd);
+  }
+  for (auto &[key, target] : targets_) {
+    if (target.prewarm != 0) {
+      Prewarm(target.addr, target.prewarm);
+    }
+  }
+}
+
+UpstreamPool::Target *UpstreamPool::GetTarget(const sockaddr_storage &addr) {
+  auto [it, inserted] = targets_.try_emplace(Key(addr));
+  if (inserted) {
+    it->second.addr = addr;
+  }
+  return &it->second;
+}
+
+std::string UpstreamPool::Key(const sockaddr_storage &addr) {
+  if (addr.ss_family == AF_INET6) {
+    const auto &sin6 = reinterpret_cast<const sockaddr_in6 &>(addr);
+    std::string key(reinterpret_cast<const char *>(&sin6.sin6_addr),
+                    sizeof(sin6.sin6_addr));
+    return key.append(reinterpret_cast<const char *>(&sin6.sin6_port),
+                      sizeof(sin6.sin6_port));
+  }
+  const auto &sin = reinterpret_cast<const sockaddr_in &>(addr);
+  std::string key(reinterpret_cast<const char *>(&sin.sin_addr),
+                  sizeof(sin.sin_addr));
+  return key.append(reinterpret_cast<const char *>(&sin.sin_port),
+                    sizeof(sin.sin_port));
+}
+
+bool UpstreamPool::IsAlive(int fd) {
+  char c{};
+  auto n = recv(fd, &c, 1, MSG_PEEK | MSG_DONTWAIT);
+  return n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK);
+}
+
+}  // namespace boots
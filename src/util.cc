@@ -1,5 +1,6 @@
 #include "util.h"
 
+#include <algorithm>
 #include <numeric>
 #include <string>
 
@@ -57,6 +58,14 @@ std::string Join(std::string_view delimiter,
       });
 }
 
+bool EqualsIgnoreCase(std::string_view lhs, std::string_view rhs) {
+  auto lower = [](char c) {
+    return c >= 'A' && c <= 'Z' ? static_cast<char>(c - 'A' + 'a') : c;
+  };
+  return std::equal(lhs.begin(), lhs.end(), rhs.begin(), rhs.end(),
+                    [&](char a, char b) { return lower(a) == lower(b); });
+}
+
 }  // namespace str
 
 namespace file {
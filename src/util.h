@@ -1,6 +1,8 @@
 #pragma once
 #include <bit>
 #include <climits>
+#include <cstdint>
+#include <cstring>
 #include <fstream>
 #include <string>
 #include <string_view>
@@ -21,6 +23,8 @@ std::string_view Trim(std::string_view s, std::string_view delimiters = kDefault
 std::vector<std::string_view> Split(std::string_view s,
                                     std::string_view delimiters = kDefaultDelimiters);
 std::string Join(std::string_view delimiter, const std::vector<std::string> &v);
+// ASCII-only, the way DNS compares names (RFC 4343).
+bool EqualsIgnoreCase(std::string_view lhs, std::string_view rhs);
 
 namespace {
 template <size_t> struct GenInt {};
@@ -33,24 +37,54 @@ template <size_t kSize> using GenIntType = typename GenInt<kSize>::type;
 
 } // namespace
 
-template <typename T> T Swap(T val) {
+template <typename T> constexpr T Swap(T val) {
   if constexpr (std::endian::little != std::endian::native) {
-    return;
+    return val;
   }
 
-  T swapped{};
   constexpr auto totalBytes = sizeof(T);
   using IntType = GenIntType<totalBytes>;
-  auto *src = reinterpret_cast<IntType *>(&val);
-  auto *dest = reinterpret_cast<IntType *>(&swapped);
-  for (int i = 0; i < totalBytes; ++i) {
-    *dest |= (*src >> (8 * (totalBytes - i - 1)) & 0xFF) << (8 * i);
+  auto raw = std::bit_cast<IntType>(val);
+  if constexpr (totalBytes == sizeof(uint16_t)) {
+    raw = __builtin_bswap16(raw);
+  } else if constexpr (totalBytes == sizeof(uint32_t)) {
+    raw = __builtin_bswap32(raw);
+  } else if constexpr (totalBytes == sizeof(uint64_t)) {
+    raw = __builtin_bswap64(raw);
   }
-  return swapped;
+  return std::bit_cast<T>(raw);
 }
 
 template <typename T> void InplaceSwap(T *val) { *val = Swap(*val); }
 
+// Big-endian (network order) load/store of integral or enum values, usable in
+// constant expressions. At runtime they lower to a single bswap + move.
+template <typename T> constexpr void StoreBigEndian(T val, uint8_t *out) {
+  using IntType = GenIntType<sizeof(T)>;
+  auto raw = static_cast<IntType>(val);
+  if (std::is_constant_evaluated()) {
+    for (size_t i = 0; i < sizeof(T); ++i) {
+      out[i] = static_cast<uint8_t>(raw >> (8 * (sizeof(T) - i - 1)));
+    }
+    return;
+  }
+  raw = Swap(raw);
+  std::memcpy(out, &raw, sizeof(raw));
+}
+
+template <typename T> constexpr T LoadBigEndian(const uint8_t *in) {
+  using IntType = GenIntType<sizeof(T)>;
+  IntType raw{};
+  if (std::is_constant_evaluated()) {
+    for (size_t i = 0; i < sizeof(T); ++i) {
+      raw = static_cast<IntType>((raw << 8) | in[i]);
+    }
+    return static_cast<T>(raw);
+  }
+  std::memcpy(&raw, in, sizeof(raw));
+  return static_cast<T>(Swap(raw));
+}
+
 } // namespace str
 
 namespace file {